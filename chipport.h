@@ -0,0 +1,4714 @@
+// ChipPort HTTP server as a header-only library. Include it from one or more
+// translation units and link with -pthread; main.cpp is the standalone server.
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstddef>
+#include <map>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <algorithm>
+#include <list>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cmath>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <new>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace chipport {
+
+inline constexpr int STATUS_SUCCESS = 200;
+inline constexpr int STATUS_NO_CONTENT = 204;
+inline constexpr int STATUS_NOT_MODIFIED = 304;
+inline constexpr int STATUS_BAD_REQUEST = 400;
+inline constexpr int STATUS_NOT_FOUND = 404;
+inline constexpr int STATUS_METHOD_NOT_ALLOWED = 405;
+inline constexpr int STATUS_REQUEST_TIMEOUT = 408;
+inline constexpr int STATUS_PAYLOAD_TOO_LARGE = 413;
+inline constexpr int STATUS_INTERNAL_SERVER_ERROR = 500;
+inline constexpr int STATUS_NOT_IMPLEMENTED = 501;
+inline constexpr int STATUS_SERVICE_UNAVAILABLE = 503;
+
+inline constexpr int READ_BUFFER_SIZE = 16384;
+inline constexpr int MAX_HEADER_SIZE = 16384;
+inline constexpr int MAX_BODY_SIZE = 1024 * 1024;
+inline constexpr int MAX_EVENTS = 256;
+inline constexpr int MAX_IOVECS = 64;
+inline constexpr int PATH_CACHE_SIZE = 1024;
+inline constexpr int MAX_FORM_FIELD_SIZE = 64 * 1024;
+inline constexpr size_t MAX_UPLOAD_SIZE = 1024UL * 1024 * 1024;   // Default per-route cap on a streamed upload body
+inline constexpr int LINGER_TIMEOUT_MS = 2000;                    // How long a rejected request's unread body is drained
+inline constexpr int LINGER_MAX_BYTES = 1024 * 1024;              // ...and how much of it, before closing anyway
+inline constexpr int HEADER_TIMEOUT_MS = 20000;                   // A request head must arrive in full within this long
+inline constexpr int BODY_TIMEOUT_MS = 20000;                     // A body gets this long...
+inline constexpr int MIN_BODY_RATE = 500;                         // ...plus a second for every this many bytes received
+inline constexpr int KEEPALIVE_TIMEOUT_MS = 60000;                // Idle connections are closed after this long
+inline constexpr int DEADLINE_CHECK_INTERVAL_MS = 1000;           // How often the deadlines above are checked
+inline constexpr int PROXY_V1_MAX_LENGTH = 107;
+inline constexpr int PROXY_V2_HEADER_LENGTH = 16;
+inline constexpr int MAX_CACHED_ASSET_SIZE = 8 * 1024 * 1024;
+inline constexpr int FINGERPRINT_LENGTH = 12;
+inline constexpr char IMMUTABLE_CACHE_CONTROL[] = "public, max-age=31536000, immutable";
+inline constexpr int ASSET_CHECK_INTERVAL_MS = 1000;
+inline constexpr int CORS_MAX_AGE = 86400;
+inline constexpr int MAX_QSBR_READERS = 64;
+inline constexpr int QSBR_OFFLINE = 0;
+inline constexpr int HOT_CACHE_ENTRIES = 8;
+inline constexpr int HOT_CACHE_TRACKED_PATHS = 256;
+inline constexpr int HOT_CACHE_MAX_OBJECT = 64 * 1024;
+inline constexpr int MAILBOX_CAPACITY = 4096;
+inline constexpr int MAILBOX_BATCH = 256;
+inline constexpr int OFFLOAD_QUEUE_LIMIT = 8192;
+inline constexpr int PRIORITY_HANDLER_THREADS = 1;                // Handler-pool workers kept for requests from admin listeners
+inline constexpr int CODEL_TARGET_MS = 5;
+inline constexpr int CODEL_INTERVAL_MS = 100;
+inline constexpr int CAPTURE_RING_CAPACITY = 4096;
+inline constexpr int CAPTURE_WRITE_INTERVAL_MS = 100;
+inline constexpr int PROFILE_MAX_DEPTH = 64;
+inline constexpr int PROFILE_MAX_SAMPLES = 16384;
+inline constexpr int PROFILE_DEFAULT_HZ = 99;
+inline constexpr int PROFILE_MAX_SECONDS = 60;
+inline constexpr int PROFILE_MIN_CODE_ADDRESS = 65536;            // Linux's default mmap_min_addr; a return address below it is junk
+inline constexpr int HEAP_PROFILE_SAMPLE_BYTES = 512 * 1024;
+inline constexpr int HEAP_PROFILE_MAX_DEPTH = 32;
+inline constexpr int HEAP_PROFILE_MAX_SAMPLES = 65536;
+inline constexpr int HEAP_PROFILE_REPORT_SITES = 25;
+inline constexpr int HEAP_PROFILE_REPORT_FRAMES = 4;
+// Set in epoll_event.data.u64 next to the fd for admin listeners and their connections
+inline constexpr uint64_t PRIORITY_EVENT_FLAG = 1ULL << 32;
+
+// A connection whose queued output exceeds the high watermark stops having its
+// pipelined requests read and parsed until the client drains it below the low one.
+inline constexpr int SEND_HIGH_WATERMARK = 1024 * 1024;
+inline constexpr int SEND_LOW_WATERMARK = 256 * 1024;
+// What one connection may do per event-loop iteration before the others get their turn
+inline constexpr int READ_BUDGET_BYTES = 4 * READ_BUFFER_SIZE;
+inline constexpr int REQUEST_BUDGET = 32;
+inline constexpr int WRITE_BUDGET_BYTES = 256 * 1024;
+// Kernel socket memory per connection. Connections sending large responses get
+// a bounded send buffer with unsent data capped by TCP_NOTSENT_LOWAT; all others,
+// and every receive side, keep the kernel's autotuning.
+inline constexpr int NOTSENT_LOWAT_BYTES = 16 * 1024;
+inline constexpr int LARGE_SOCKET_BUFFER = 256 * 1024;
+inline constexpr int LARGE_RESPONSE_SIZE = 64 * 1024;
+
+inline void log(const std::string& level, const std::string& className, const std::string& method, const std::string& why, const std::string& data) {
+    // One write per line, so lines from different event-loop threads do not interleave
+    std::string line = "[" + level + "][" + className + "][" + method + "] <" + why + "> " + data + "\n";
+    std::cout << line << std::flush;
+}
+
+inline std::string getContentType(const std::string& filename) {
+    std::unordered_map<std::string, std::string> extensionToContentType = {
+        {".html", "text/html"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".png", "image/png"},
+        {".css", "text/css"},
+        {".js", "application/javascript"}
+    };
+
+    size_t dotPosition = filename.find_last_of('.');
+    if (dotPosition != std::string::npos) {
+        std::string extension = filename.substr(dotPosition);
+        if (extensionToContentType.count(extension)) {
+            log("INFO", "getContentType", "Extension match", "Content-Type found for", extension);
+            return extensionToContentType[extension];
+        } else {
+            log("WARN", "getContentType", "Extension mismatch", "No content type for", extension);
+        }
+    }
+    return "application/octet-stream"; // Default content type if no match found
+}
+
+inline std::string getStatusText(int code) {
+    switch (code) {
+        case STATUS_SUCCESS: return "OK";
+        case STATUS_NO_CONTENT: return "No Content";
+        case STATUS_NOT_MODIFIED: return "Not Modified";
+        case STATUS_BAD_REQUEST: return "Bad Request";
+        case STATUS_NOT_FOUND: return "Not Found";
+        case STATUS_METHOD_NOT_ALLOWED: return "Method Not Allowed";
+        case STATUS_REQUEST_TIMEOUT: return "Request Timeout";
+        case STATUS_PAYLOAD_TOO_LARGE: return "Payload Too Large";
+        case STATUS_INTERNAL_SERVER_ERROR: return "Internal Server Error";
+        case STATUS_NOT_IMPLEMENTED: return "Not Implemented";
+        case STATUS_SERVICE_UNAVAILABLE: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+// Formats an IPv4/IPv6 socket address as "host:port" ("[host]:port" for IPv6).
+inline std::string formatAddress(const struct sockaddr* address) {
+    char host[INET6_ADDRSTRLEN] = {0};
+    if (address->sa_family == AF_INET) {
+        const auto* ipv4 = reinterpret_cast<const struct sockaddr_in*>(address);
+        inet_ntop(AF_INET, &ipv4->sin_addr, host, sizeof(host));
+        return std::string(host) + ":" + std::to_string(ntohs(ipv4->sin_port));
+    }
+    if (address->sa_family == AF_INET6) {
+        const auto* ipv6 = reinterpret_cast<const struct sockaddr_in6*>(address);
+        inet_ntop(AF_INET6, &ipv6->sin6_addr, host, sizeof(host));
+        return "[" + std::string(host) + "]:" + std::to_string(ntohs(ipv6->sin6_port));
+    }
+    if (address->sa_family == AF_UNIX) {
+        return "unix";
+    }
+    return "unknown";
+}
+
+// Case-insensitive header lookup, returns an empty string when the header is missing.
+inline std::string findHeader(const std::map<std::string, std::string>& headers, const std::string& name) {
+    for (const auto& header : headers) {
+        if (header.first.size() == name.size() && strncasecmp(header.first.c_str(), name.c_str(), name.size()) == 0) {
+            return header.second;
+        }
+    }
+    return "";
+}
+
+// Escapes a string for use inside a JSON string literal.
+inline std::string jsonEscape(std::string_view text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (char c : text) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\r': escaped += "\\r"; break;
+            case '\t': escaped += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char code[8];
+                    snprintf(code, sizeof(code), "\\u%04x", c);
+                    escaped += code;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped;
+}
+
+inline int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes %XX escapes (and '+' when decoding a query component); malformed escapes are kept literally.
+inline std::string percentDecode(std::string_view text, bool plusAsSpace = false) {
+    std::string decoded;
+    decoded.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '%' && i + 2 < text.size() && hexValue(text[i + 1]) >= 0 && hexValue(text[i + 2]) >= 0) {
+            decoded += static_cast<char>(hexValue(text[i + 1]) * 16 + hexValue(text[i + 2]));
+            i += 2;
+        } else if (plusAsSpace && text[i] == '+') {
+            decoded += ' ';
+        } else {
+            decoded += text[i];
+        }
+    }
+    return decoded;
+}
+
+// True if the path contains a percent escape, a duplicate slash or a dot segment
+// candidate ("/."). Conservative: "/.hidden" also takes the slow path.
+inline bool pathNeedsNormalization(std::string_view path) {
+    size_t i = 0;
+    bool previousSlash = false;
+#ifdef __SSE2__
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dot = _mm_set1_epi8('.');
+    for (; i + 16 <= path.size(); i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(path.data() + i));
+        unsigned percentMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, percent));
+        unsigned slashMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, slash));
+        unsigned dotMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dot));
+        // Shift the slashes one byte forward, carrying the last byte of the previous chunk
+        unsigned slashBefore = (slashMask << 1) | (previousSlash ? 1u : 0u);
+        if (percentMask || (slashBefore & (slashMask | dotMask))) {
+            return true;
+        }
+        previousSlash = (slashMask & 0x8000) != 0;
+    }
+#endif
+    for (; i < path.size(); ++i) {
+        char c = path[i];
+        if (c == '%' || (previousSlash && (c == '/' || c == '.'))) {
+            return true;
+        }
+        previousSlash = c == '/';
+    }
+    return false;
+}
+
+// Percent-decodes the path and resolves "." / ".." segments and duplicate slashes.
+inline std::string normalizePathSlow(std::string_view rawPath) {
+    std::string decoded = percentDecode(rawPath);
+    std::vector<std::string_view> segments;
+    std::string_view rest = decoded;
+    while (!rest.empty()) {
+        size_t slash = rest.find('/');
+        std::string_view segment = rest.substr(0, slash);
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+        if (segment.empty() || segment == ".") {
+            continue;
+        }
+        if (segment == "..") {
+            if (!segments.empty()) {
+                segments.pop_back();
+            }
+            continue;
+        }
+        segments.push_back(segment);
+    }
+
+    std::string normalized;
+    for (const auto& segment : segments) {
+        normalized += '/';
+        normalized.append(segment.data(), segment.size());
+    }
+    // "/a/", "/a/." and "/a/.." all name a directory and keep their trailing slash
+    std::string_view last = std::string_view(decoded).substr(decoded.rfind('/') + 1);
+    bool trailingSlash = last.empty() || last == "." || last == "..";
+    if (normalized.empty() || trailingSlash) {
+        normalized += '/';
+    }
+    return normalized;
+}
+
+// Subsystems that memory is accounted to, see MemoryAccount.
+enum MemoryTag {
+    MEMORY_CONNECTIONS,         // Connection state, input buffers, owned output and upload parsers
+    MEMORY_ASSET_CACHE,         // Cached (and minified) asset bodies
+    MEMORY_HOT_CACHE,           // Per-loop rendered responses
+    MEMORY_PREFLIGHTS,          // Pre-rendered CORS preflight responses
+    MEMORY_PATH_CACHE,          // Normalized request paths
+    MEMORY_MAILBOXES,           // Event-loop mailbox rings
+    MEMORY_CAPTURE,             // Traffic capture ring
+    MEMORY_TAG_COUNT
+};
+
+inline const char* memoryTagName(MemoryTag tag) {
+    static const char* names[MEMORY_TAG_COUNT] = {"connections", "asset_cache", "hot_cache", "preflights", "path_cache", "mailboxes", "capture"};
+    return names[tag];
+}
+
+// Bytes held per subsystem. Every thread counts into its own cache line, so
+// accounting costs a plain add; totals() sums the threads when asked. Memory
+// freed on another thread than it was allocated on leaves one counter negative
+// and the other positive, which the sum evens out.
+class MemoryAccount {
+public:
+    static void add(MemoryTag tag, int64_t bytes) {
+        std::atomic<int64_t>& counter = local().bytes[tag];
+        counter.store(counter.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+    }
+
+    static std::vector<int64_t> totals() {
+        std::vector<int64_t> sums(MEMORY_TAG_COUNT, 0);
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (const Counters* counters : registry()) {
+            for (int tag = 0; tag < MEMORY_TAG_COUNT; ++tag) {
+                sums[tag] += counters->bytes[tag].load(std::memory_order_relaxed);
+            }
+        }
+        return sums;
+    }
+
+private:
+    struct alignas(64) Counters {
+        std::atomic<int64_t> bytes[MEMORY_TAG_COUNT];
+    };
+
+    // Counters outlive their thread: what it allocated may still be in use
+    static Counters& local() {
+        thread_local Counters* counters = [] {
+            Counters* created = new Counters();
+            std::lock_guard<std::mutex> lock(registryMutex());
+            registry().push_back(created);
+            return created;
+        }();
+        return *counters;
+    }
+
+    static std::mutex& registryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<Counters*>& registry() {
+        static std::vector<Counters*> counters;
+        return counters;
+    }
+};
+
+// Shares `text`, accounting it to `tag` for as long as any owner holds it.
+inline std::shared_ptr<const std::string> trackedString(MemoryTag tag, std::string text) {
+    int64_t bytes = sizeof(std::string) + text.capacity();
+    MemoryAccount::add(tag, bytes);
+    return std::shared_ptr<const std::string>(new std::string(std::move(text)), [tag, bytes](const std::string* tracked) {
+        MemoryAccount::add(tag, -bytes);
+        delete tracked;
+    });
+}
+
+// Returns the normalized form of `rawPath`. The common case needs no work and the
+// original slice is returned as is; otherwise the result is shared from a small
+// per-thread cache and kept alive through `storage`.
+inline std::string_view normalizePath(std::string_view rawPath, std::shared_ptr<const std::string>& storage) {
+    if (rawPath.empty() || rawPath[0] != '/' || !pathNeedsNormalization(rawPath)) {
+        return rawPath;
+    }
+
+    thread_local std::unordered_map<std::string, std::shared_ptr<const std::string>> cache;
+    auto cached = cache.find(std::string(rawPath));
+    if (cached != cache.end()) {
+        storage = cached->second;
+        return *storage;
+    }
+
+    std::string normalized = normalizePathSlow(rawPath);
+    if (normalized == rawPath) {
+        return rawPath;
+    }
+    if (cache.size() >= PATH_CACHE_SIZE) {
+        cache.clear();
+    }
+    storage = trackedString(MEMORY_PATH_CACHE, std::move(normalized));
+    cache.emplace(std::string(rawPath), storage);
+    return *storage;
+}
+
+struct MultipartSink;
+
+struct Request {
+    std::string raw;                  // Owns the bytes the views below point into
+    std::string method;
+    std::string_view target;          // Request target exactly as sent, including the query
+    std::string_view path;            // Decoded, normalized path; a slice of `raw` when nothing had to change
+    std::string_view query;           // Raw query string without the leading '?'
+    std::string httpVersion;
+    std::map<std::string, std::string> headers;
+    std::string body;
+    std::map<std::string, std::string> formFields;   // Filled in for streamed multipart uploads
+    std::vector<std::string> uploadedFiles;
+    std::shared_ptr<MultipartSink> uploadSink;   // Sink that consumed a streamed upload, kept as long as the request
+    std::string clientAddress;                        // Real client, as reported by a PROXY header if one was sent
+
+    explicit Request(std::string requestText) : raw(std::move(requestText)) {
+        std::string_view text = raw;
+        size_t lineEnd = text.find("\r\n");
+        std::string_view requestLine = text.substr(0, lineEnd);
+
+        size_t methodEnd = requestLine.find(' ');
+        if (methodEnd != std::string_view::npos) {
+            method = std::string(requestLine.substr(0, methodEnd));
+            size_t targetEnd = requestLine.find(' ', methodEnd + 1);
+            target = requestLine.substr(methodEnd + 1, targetEnd == std::string_view::npos ? std::string_view::npos : targetEnd - methodEnd - 1);
+            if (targetEnd != std::string_view::npos) {
+                httpVersion = std::string(requestLine.substr(targetEnd + 1));
+            }
+        }
+
+        size_t queryStart = target.find('?');
+        std::string_view rawPath = target.substr(0, queryStart);
+        if (queryStart != std::string_view::npos) {
+            query = target.substr(queryStart + 1);
+        }
+        path = normalizePath(rawPath, normalizedPath);
+
+        size_t pos = lineEnd == std::string_view::npos ? text.size() : lineEnd + 2;
+        while (pos < text.size()) {
+            size_t end = text.find("\r\n", pos);
+            if (end == std::string_view::npos || end == pos) {
+                pos = end == std::string_view::npos ? text.size() : end + 2;
+                break;
+            }
+            std::string_view line = text.substr(pos, end - pos);
+            auto colonPos = line.find(':');
+            if (colonPos != std::string_view::npos) {
+                std::string_view headerValue = line.substr(colonPos + 1);
+                while (!headerValue.empty() && (headerValue.front() == ' ' || headerValue.front() == '\t')) {
+                    headerValue.remove_prefix(1);
+                }
+                headers[std::string(line.substr(0, colonPos))] = std::string(headerValue);
+            }
+            pos = end + 2;
+        }
+
+        body = raw.substr(pos);
+        log("INFO", "Request", "Constructor", "Parsed request", "Method: " + method + ", Path: " + std::string(path));
+    }
+
+    // Views into `raw` must stay valid, so requests are never copied or moved
+    Request(const Request&) = delete;
+    Request& operator=(const Request&) = delete;
+
+    // Query parameters as raw slices, split on first use only.
+    const std::vector<std::pair<std::string_view, std::string_view>>& queryParams() const {
+        if (!queryParsed) {
+            std::string_view rest = query;
+            while (!rest.empty()) {
+                size_t amp = rest.find('&');
+                std::string_view pair = rest.substr(0, amp);
+                rest = amp == std::string_view::npos ? std::string_view() : rest.substr(amp + 1);
+                if (pair.empty()) {
+                    continue;
+                }
+                size_t equals = pair.find('=');
+                if (equals == std::string_view::npos) {
+                    parsedQuery.emplace_back(pair, std::string_view());
+                } else {
+                    parsedQuery.emplace_back(pair.substr(0, equals), pair.substr(equals + 1));
+                }
+            }
+            queryParsed = true;
+        }
+        return parsedQuery;
+    }
+
+    // Decoded value of the first query parameter called `name`, empty if absent.
+    std::string queryParam(std::string_view name) const {
+        for (const auto& param : queryParams()) {
+            if (param.first == name) {
+                return percentDecode(param.second, true);
+            }
+        }
+        return "";
+    }
+
+private:
+    std::shared_ptr<const std::string> normalizedPath;
+    mutable std::vector<std::pair<std::string_view, std::string_view>> parsedQuery;
+    mutable bool queryParsed = false;
+};
+
+struct Response {
+    int code;
+    std::string body;
+    std::string contentType;
+    int fileFd = -1;       // When set the body is streamed from this file instead of `body`
+    size_t fileSize = 0;
+    std::shared_ptr<const std::string> sharedBody;     // When set the body is these cached bytes, sent without copying
+    std::vector<std::pair<std::string, std::string>> headers;  // Sent in addition to the standard ones
+    bool shareable = false;    // Identical for every unconditional GET of the path, so workers may cache it
+
+    size_t contentLength() const {
+        if (sharedBody) {
+            return sharedBody->size();
+        }
+        return fileFd >= 0 ? fileSize : body.length();
+    }
+
+    std::string buildHeader(bool keepAlive) const {
+        std::ostringstream header;
+        header << "HTTP/1.1 " << code << " " << getStatusText(code) << "\r\n";
+        if (!contentType.empty()) {
+            header << "Content-Type: " << contentType << "\r\n";
+        }
+        if (code != STATUS_NOT_MODIFIED && code != STATUS_NO_CONTENT) {
+            header << "Content-Length: " << contentLength() << "\r\n";
+        }
+        for (const auto& extra : headers) {
+            header << extra.first << ": " << extra.second << "\r\n";
+        }
+        header << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n\r\n";
+        return header.str();
+    }
+
+    std::string buildResponse() const {
+        return buildHeader(false) + (sharedBody ? *sharedBody : body);
+    }
+};
+
+struct MultipartPart {
+    std::map<std::string, std::string> headers;
+    std::string name;                 // Form field name from Content-Disposition
+    std::string filename;             // Set for file parts only
+};
+
+// Receives the parts of a multipart body as they stream in. Returning false from
+// onData or onEnd aborts the parse.
+struct MultipartSink {
+    virtual ~MultipartSink() = default;
+    virtual bool onBegin(const MultipartPart& part) = 0;
+    virtual bool onData(const char* data, size_t length) = 0;
+    virtual bool onEnd() = 0;
+
+    int errorStatus = 0;              // Status to answer with when the sink aborted the parse (400 if unset)
+};
+
+// Boyer-Moore-Horspool search for a fixed needle.
+class HorspoolSearcher {
+public:
+    explicit HorspoolSearcher(const std::string& needle) : needle(needle) {
+        std::fill(std::begin(skip), std::end(skip), needle.size());
+        for (size_t i = 0; i + 1 < needle.size(); ++i) {
+            skip[static_cast<unsigned char>(needle[i])] = needle.size() - 1 - i;
+        }
+    }
+
+    // Position of the first match in [data, data + length), or std::string::npos.
+    size_t find(const char* data, size_t length) const {
+        size_t n = needle.size();
+        const char last = needle[n - 1];
+        for (size_t pos = 0; pos + n <= length; pos += skip[static_cast<unsigned char>(data[pos + n - 1])]) {
+            if (data[pos + n - 1] == last && memcmp(data + pos, needle.data(), n - 1) == 0) {
+                return pos;
+            }
+        }
+        return std::string::npos;
+    }
+
+private:
+    std::string needle;
+    size_t skip[256];
+};
+
+// Incremental multipart/form-data parser. Fragments are fed as they arrive and
+// only up to one delimiter's worth of bytes is ever held back between them, so
+// memory use does not depend on the size of the body.
+class MultipartParser {
+public:
+    MultipartParser(const std::string& boundary, MultipartSink& sink)
+        : delimiter("\r\n--" + boundary), searcher(delimiter), sink(sink) {
+        // The first delimiter is not preceded by a line break; pretend it was
+        carry = "\r\n";
+    }
+
+    bool feed(const char* data, size_t length) {
+        while (length > 0 && state != State::Done && state != State::Failed) {
+            if (carry.empty()) {
+                size_t used = process(data, length);
+                carry.assign(data + used, length - used);
+                break;
+            }
+
+            // Bytes held back from the previous fragment may begin a delimiter; resolve
+            // them in a small window joined with the head of this fragment
+            size_t take = std::min(length, delimiter.size());
+            std::string window = carry;
+            window.append(data, take);
+            size_t used = process(window.data(), window.size());
+            if (used < carry.size()) {
+                carry = window.substr(used);
+                data += take;
+                length -= take;
+            } else {
+                data += used - carry.size();
+                length -= used - carry.size();
+                carry.clear();
+            }
+        }
+        return state != State::Failed;
+    }
+
+    bool finished() const {
+        return state == State::Done;
+    }
+
+private:
+    enum class State { Preamble, AfterDelimiter, Headers, Body, Done, Failed };
+
+    // Consumes as much of [data, data + length) as can be decided and returns how
+    // many bytes were used; the remainder must be presented again with more data.
+    size_t process(const char* data, size_t length) {
+        size_t pos = 0;
+        while (pos < length) {
+            switch (state) {
+                case State::Preamble:
+                case State::Body: {
+                    size_t match = searcher.find(data + pos, length - pos);
+                    if (match == std::string::npos) {
+                        size_t keep = partialMatch(data + pos, length - pos);
+                        if (state == State::Body && !emit(data + pos, length - pos - keep)) {
+                            return length;
+                        }
+                        return length - keep;
+                    }
+                    if (state == State::Body && (!emit(data + pos, match) || !end())) {
+                        return length;
+                    }
+                    pos += match + delimiter.size();
+                    state = State::AfterDelimiter;
+                    break;
+                }
+                case State::AfterDelimiter:
+                    if (data[pos] == ' ' || data[pos] == '\t') {
+                        ++pos;      // Transport padding
+                        break;
+                    }
+                    if (length - pos < 2) {
+                        return pos;
+                    }
+                    if (data[pos] == '-' && data[pos + 1] == '-') {
+                        state = State::Done;
+                        return length;
+                    }
+                    if (data[pos] != '\r' || data[pos + 1] != '\n') {
+                        state = State::Failed;
+                        return length;
+                    }
+                    // The line break stays part of the header block so an empty block is "\r\n\r\n"
+                    headerBlock.clear();
+                    state = State::Headers;
+                    break;
+                case State::Headers: {
+                    size_t previous = headerBlock.size();
+                    headerBlock.append(data + pos, length - pos);
+                    size_t headerEnd = headerBlock.find("\r\n\r\n", previous >= 3 ? previous - 3 : 0);
+                    if (headerEnd == std::string::npos) {
+                        if (headerBlock.size() > MAX_HEADER_SIZE) {
+                            state = State::Failed;
+                        }
+                        return length;
+                    }
+                    pos += headerEnd + 4 - previous;
+                    headerBlock.resize(headerEnd + 2);
+                    if (!begin()) {
+                        return length;
+                    }
+                    state = State::Body;
+                    break;
+                }
+                case State::Done:
+                case State::Failed:
+                    return length;
+            }
+        }
+        return pos;
+    }
+
+    // Length of the longest suffix of the data that is a proper prefix of the delimiter.
+    size_t partialMatch(const char* data, size_t length) const {
+        size_t longest = std::min(length, delimiter.size() - 1);
+        for (size_t keep = longest; keep > 0; --keep) {
+            if (memcmp(data + length - keep, delimiter.data(), keep) == 0) {
+                return keep;
+            }
+        }
+        return 0;
+    }
+
+    bool begin() {
+        MultipartPart part;
+        size_t pos = 2;
+        while (pos < headerBlock.size()) {
+            size_t end = headerBlock.find("\r\n", pos);
+            std::string line = headerBlock.substr(pos, end - pos);
+            pos = end + 2;
+            size_t colonPos = line.find(':');
+            if (colonPos == std::string::npos) {
+                continue;
+            }
+            size_t valueStart = line.find_first_not_of(" \t", colonPos + 1);
+            part.headers[line.substr(0, colonPos)] = valueStart == std::string::npos ? "" : line.substr(valueStart);
+        }
+
+        std::string disposition = findHeader(part.headers, "Content-Disposition");
+        part.name = dispositionParameter(disposition, "name");
+        part.filename = dispositionParameter(disposition, "filename");
+        if (!sink.onBegin(part)) {
+            state = State::Failed;
+            return false;
+        }
+        return true;
+    }
+
+    bool emit(const char* data, size_t length) {
+        if (length > 0 && !sink.onData(data, length)) {
+            state = State::Failed;
+            return false;
+        }
+        return true;
+    }
+
+    bool end() {
+        if (!sink.onEnd()) {
+            state = State::Failed;
+            return false;
+        }
+        return true;
+    }
+
+    static std::string dispositionParameter(const std::string& disposition, const std::string& name) {
+        size_t pos = 0;
+        while ((pos = disposition.find(';', pos)) != std::string::npos) {
+            size_t keyStart = disposition.find_first_not_of(" \t", pos + 1);
+            pos = keyStart;
+            if (keyStart == std::string::npos) {
+                break;
+            }
+            size_t equals = disposition.find('=', keyStart);
+            if (equals == std::string::npos || disposition.compare(keyStart, equals - keyStart, name) != 0 || equals - keyStart != name.size()) {
+                continue;
+            }
+            if (equals + 1 < disposition.size() && disposition[equals + 1] == '"') {
+                size_t close = disposition.find('"', equals + 2);
+                return disposition.substr(equals + 2, close == std::string::npos ? std::string::npos : close - equals - 2);
+            }
+            size_t end = disposition.find(';', equals);
+            return disposition.substr(equals + 1, end == std::string::npos ? std::string::npos : end - equals - 1);
+        }
+        return "";
+    }
+
+    std::string delimiter;
+    HorspoolSearcher searcher;
+    MultipartSink& sink;
+    State state = State::Preamble;
+    std::string carry;
+    std::string headerBlock;
+};
+
+// Extracts the boundary from a multipart/form-data Content-Type, empty if it is not one.
+inline std::string multipartBoundary(const std::string& contentType) {
+    if (strncasecmp(contentType.c_str(), "multipart/form-data", 19) != 0) {
+        return "";
+    }
+    size_t pos = contentType.find("boundary=");
+    if (pos == std::string::npos) {
+        return "";
+    }
+    std::string boundary = contentType.substr(pos + 9);
+    if (!boundary.empty() && boundary[0] == '"') {
+        boundary = boundary.substr(1, boundary.find('"', 1) - 1);
+    } else {
+        boundary = boundary.substr(0, boundary.find_first_of("; \t"));
+    }
+    return boundary.size() <= 70 ? boundary : "";
+}
+
+// Spills file parts of an upload straight to disk and keeps the (small) plain
+// form fields in memory. The files are removed with the spooler, which the
+// request holds until it has been answered, unless the upload completed and
+// `keep` is set.
+class UploadSpooler : public MultipartSink {
+public:
+    UploadSpooler(const std::string& directory, bool keep) : directory(directory), keep(keep) {}
+
+    ~UploadSpooler() override {
+        closeFile();
+        if (!committed || !keep) {
+            for (const auto& path : files) {
+                unlink(path.c_str());
+            }
+        }
+    }
+
+    bool onBegin(const MultipartPart& part) override {
+        current = part;
+        if (part.filename.empty()) {
+            fields[part.name].clear();
+            return true;
+        }
+
+        // The counter restarts with the process, so names left by an earlier run are skipped
+        mkdir(directory.c_str(), 0755);
+        std::string path;
+        do {
+            path = directory + "/" + std::to_string(getpid()) + "-" + std::to_string(++uploadCounter) + "-" + sanitizeFilename(part.filename);
+            fileFd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        } while (fileFd == -1 && errno == EEXIST);
+        if (fileFd == -1) {
+            log("ERROR", "UploadSpooler", "onBegin", "Creating upload file failed", path + ": " + strerror(errno));
+            errorStatus = STATUS_INTERNAL_SERVER_ERROR;
+            return false;
+        }
+        files.push_back(path);
+        return true;
+    }
+
+    bool onData(const char* data, size_t length) override {
+        if (fileFd == -1) {
+            std::string& value = fields[current.name];
+            if (value.size() + length > MAX_FORM_FIELD_SIZE) {
+                log("ERROR", "UploadSpooler", "onData", "Form field too large", current.name);
+                errorStatus = STATUS_PAYLOAD_TOO_LARGE;
+                return false;
+            }
+            value.append(data, length);
+            return true;
+        }
+        while (length > 0) {
+            ssize_t written = write(fileFd, data, length);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                log("ERROR", "UploadSpooler", "onData", "Writing upload failed", files.back() + ": " + strerror(errno));
+                errorStatus = STATUS_INTERNAL_SERVER_ERROR;
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    bool onEnd() override {
+        if (fileFd != -1) {
+            log("INFO", "UploadSpooler", "onEnd", "File stored", files.back());
+        }
+        closeFile();
+        return true;
+    }
+
+    void commit() {
+        committed = true;
+    }
+
+    std::map<std::string, std::string> fields;
+    std::vector<std::string> files;
+
+private:
+    void closeFile() {
+        if (fileFd != -1) {
+            close(fileFd);
+            fileFd = -1;
+        }
+    }
+
+    static std::string sanitizeFilename(const std::string& filename) {
+        std::string name = filename.substr(filename.find_last_of("/\\") + 1);
+        for (auto& c : name) {
+            if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-' && c != '_') {
+                c = '_';
+            }
+        }
+        if (name.empty() || name[0] == '.') {
+            name = "upload" + name;
+        }
+        return name;
+    }
+
+    static inline std::atomic<unsigned long> uploadCounter{0};
+
+    std::string directory;
+    bool keep;
+    MultipartPart current;
+    int fileFd = -1;
+    bool committed = false;
+};
+
+struct Asset {
+    std::shared_ptr<const std::string> content;
+    std::string contentType;
+    std::string hash;                 // Hex FNV-1a of the bytes as served
+    std::string etag;
+    size_t sourceSize;                // Size on disk, before load-time transformations
+    struct timespec modified;         // mtime at load, to notice when the file changes
+};
+
+// 64-bit FNV-1a, plenty to tell versions of the same asset apart.
+inline std::string contentHash(const std::string& data) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+    return std::string(hex, FINGERPRINT_LENGTH);
+}
+
+// "/static/style.css" -> "/static/style.<hash>.css"
+inline std::string fingerprintUrl(const std::string& url, const std::string& hash) {
+    size_t slash = url.rfind('/');
+    size_t dot = url.rfind('.');
+    if (dot == std::string::npos || dot < slash) {
+        return url + "." + hash;
+    }
+    return url.substr(0, dot) + "." + hash + url.substr(dot);
+}
+
+// Reads a whole file for the asset cache. Fails for missing files and for files
+// too large to keep in memory, which are then served from disk instead.
+inline bool readAssetFile(const std::string& path, std::string& content, struct timespec& modified) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat fileStat;
+    if (fd == -1 || fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        log("ERROR", "readAssetFile", "Failed to open", "Asset", path);
+        return false;
+    }
+    if (static_cast<size_t>(fileStat.st_size) > MAX_CACHED_ASSET_SIZE) {
+        close(fd);
+        log("WARN", "readAssetFile", "Too large to cache", "Served from disk", path);
+        return false;
+    }
+
+    content.resize(fileStat.st_size);
+    size_t total = 0;
+    while (total < content.size()) {
+        ssize_t received = read(fd, &content[total], content.size() - total);
+        if (received <= 0) {
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total += received;
+    }
+    close(fd);
+    content.resize(total);
+    modified = fileStat.st_mtim;
+    return true;
+}
+
+// Strips comments and insignificant whitespace from a stylesheet. Strings are
+// copied untouched, and a space is only removed where CSS syntax makes it
+// meaningless (so "a :hover" and "calc(1px + 2px)" keep theirs).
+inline std::string minifyCss(std::string_view css) {
+    static const char* dropAfter = "{};,>:";
+    static const char* dropBefore = "{};,>";
+    std::string out;
+    out.reserve(css.size());
+    bool pendingSpace = false;
+
+    for (size_t i = 0; i < css.size(); ++i) {
+        char c = css[i];
+        if (c == '/' && i + 1 < css.size() && css[i + 1] == '*') {
+            size_t end = css.find("*/", i + 2);
+            i = end == std::string_view::npos ? css.size() : end + 1;
+            pendingSpace = true;
+            continue;
+        }
+        if (isspace(static_cast<unsigned char>(c))) {
+            pendingSpace = true;
+            continue;
+        }
+        if (pendingSpace && !out.empty() && !strchr(dropAfter, out.back()) && !strchr(dropBefore, c)) {
+            out += ' ';
+        }
+        pendingSpace = false;
+
+        if (c == '"' || c == '\'') {
+            size_t end = i + 1;
+            while (end < css.size() && css[end] != c) {
+                end += css[end] == '\\' ? 2 : 1;
+            }
+            out.append(css.substr(i, std::min(end, css.size() - 1) - i + 1));
+            i = end;
+            continue;
+        }
+        if (c == '}' && !out.empty() && out.back() == ';') {
+            out.pop_back();
+        }
+        out += c;
+    }
+    return out;
+}
+
+// Lower-case name of the tag starting at `html[lt]`, without a leading '/'.
+inline std::string htmlTagName(std::string_view html, size_t lt) {
+    size_t start = lt + 1 < html.size() && html[lt + 1] == '/' ? lt + 2 : lt + 1;
+    size_t end = start;
+    while (end < html.size() && (isalnum(static_cast<unsigned char>(html[end])) || html[end] == '!')) {
+        ++end;
+    }
+    std::string name(html.substr(start, end - start));
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return tolower(c); });
+    return name;
+}
+
+// Elements that never sit inline in running text, so whitespace next to them
+// does not render.
+inline bool isBlockTag(const std::string& name) {
+    static const char* blockTags[] = {
+        "!doctype", "html", "head", "body", "title", "meta", "link", "base", "script", "style", "noscript",
+        "div", "p", "section", "article", "header", "footer", "nav", "main", "aside", "h1", "h2", "h3", "h4", "h5", "h6",
+        "ul", "ol", "li", "dl", "dt", "dd", "table", "thead", "tbody", "tfoot", "tr", "td", "th", "caption",
+        "form", "fieldset", "legend", "blockquote", "figure", "figcaption", "hr", "pre", "address", "details", "summary",
+    };
+    return std::any_of(std::begin(blockTags), std::end(blockTags), [&name](const char* tag) { return name == tag; });
+}
+
+// Removes comments and collapses whitespace in HTML. Whitespace-only runs that
+// span a line break between two block-level tags are dropped, other runs become
+// one space. Attribute values and the contents of pre, textarea, script and
+// style are kept verbatim.
+inline std::string minifyHtml(std::string_view html) {
+    static const char* rawElements[] = {"pre", "textarea", "script", "style"};
+    std::string out;
+    out.reserve(html.size());
+    bool inTag = false;
+    std::string previousTag;            // Name of the last tag written
+
+    for (size_t i = 0; i < html.size(); ++i) {
+        char c = html[i];
+        if (!inTag && html.compare(i, 4, "<!--") == 0 && html.compare(i, 7, "<!--[if") != 0) {
+            size_t end = html.find("-->", i + 4);
+            i = end == std::string_view::npos ? html.size() : end + 2;
+            continue;
+        }
+        if (!inTag && c == '<') {
+            previousTag = htmlTagName(html, i);
+            bool raw = false;
+            for (const char* element : rawElements) {
+                size_t length = strlen(element);
+                if (i + 1 + length < html.size() && strncasecmp(html.data() + i + 1, element, length) == 0
+                        && (html[i + 1 + length] == '>' || isspace(static_cast<unsigned char>(html[i + 1 + length])))) {
+                    std::string closing = "</" + std::string(element) + ">";
+                    size_t end = html.find(closing, i);
+                    end = end == std::string_view::npos ? html.size() : end + closing.size();
+                    out.append(html.substr(i, end - i));
+                    i = end - 1;
+                    raw = true;
+                    break;
+                }
+            }
+            if (raw) {
+                continue;
+            }
+            inTag = true;
+        } else if (inTag && (c == '"' || c == '\'')) {
+            size_t end = html.find(c, i + 1);
+            end = end == std::string_view::npos ? html.size() - 1 : end;
+            out.append(html.substr(i, end - i + 1));
+            i = end;
+            continue;
+        } else if (inTag && c == '>') {
+            inTag = false;
+        } else if (isspace(static_cast<unsigned char>(c))) {
+            size_t end = i;
+            bool lineBreak = false;
+            while (end < html.size() && isspace(static_cast<unsigned char>(html[end]))) {
+                lineBreak = lineBreak || html[end] == '\n';
+                ++end;
+            }
+            // Comments are dropped anyway, so the tag after them is the neighbour
+            size_t next = end;
+            while (html.compare(next, 4, "<!--") == 0 && html.compare(next, 7, "<!--[if") != 0) {
+                size_t close = html.find("-->", next + 4);
+                next = close == std::string_view::npos ? html.size() : close + 3;
+                while (next < html.size() && isspace(static_cast<unsigned char>(html[next]))) {
+                    lineBreak = lineBreak || html[next] == '\n';
+                    ++next;
+                }
+            }
+            bool betweenTags = (out.empty() || (out.back() == '>' && isBlockTag(previousTag)))
+                               && (next == html.size() || (html[next] == '<' && isBlockTag(htmlTagName(html, next))));
+            if (!(lineBreak && betweenTags && !inTag) && (out.empty() || out.back() != ' ')) {
+                out += ' ';
+            }
+            i = end - 1;
+            continue;
+        }
+        out += c;
+    }
+    return out;
+}
+
+// Static files kept in memory, loaded and hashed once at startup and again
+// whenever one of them changes on disk.
+class AssetCache {
+public:
+    // Stores `content`, hashed to `hash`, as the served representation of `path`.
+    // The bytes may be shared with other caches.
+    const Asset* store(const std::string& path, std::shared_ptr<const std::string> content, const std::string& hash,
+                       size_t sourceSize, const struct timespec& modified) {
+        Asset* asset = &assets[path];
+        asset->hash = hash;
+        asset->etag = "\"" + hash + "\"";
+        asset->contentType = getContentType(path);
+        asset->sourceSize = sourceSize;
+        asset->modified = modified;
+        asset->content = std::move(content);
+        return asset;
+    }
+
+    const Asset* find(const std::string& path) const {
+        auto asset = assets.find(path);
+        return asset == assets.end() ? nullptr : &asset->second;
+    }
+
+    // True if a cached file was modified or removed since it was loaded.
+    bool changedOnDisk() const {
+        for (const auto& asset : assets) {
+            struct stat fileStat;
+            if (stat(asset.first.c_str(), &fileStat) == -1
+                    || fileStat.st_mtim.tv_sec != asset.second.modified.tv_sec
+                    || fileStat.st_mtim.tv_nsec != asset.second.modified.tv_nsec) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    std::map<std::string, Asset> assets;
+};
+
+// Cross-origin access to a route.
+struct CorsPolicy {
+    std::vector<std::string> allowedOrigins;   // "*" admits any origin
+    std::string allowedHeaders = "Content-Type";
+    int maxAge = CORS_MAX_AGE;                 // How long browsers may cache the preflight
+
+    // Value for Access-Control-Allow-Origin, empty if `origin` is not admitted.
+    std::string allowOrigin(const std::string& origin) const {
+        for (const auto& allowed : allowedOrigins) {
+            if (allowed == "*" || allowed == origin) {
+                return allowed;
+            }
+        }
+        return "";
+    }
+};
+
+// Complete preflight responses for one admitted origin.
+struct Preflight {
+    std::shared_ptr<const std::string> response;        // keep-alive
+    std::shared_ptr<const std::string> closeResponse;   // Same response with "Connection: close"
+};
+
+using RouteHandler = std::function<Response(const Request&)>;
+// Called with the head of an upload, before the body arrives
+using UploadSinkFactory = std::function<std::shared_ptr<MultipartSink>(const Request&)>;
+
+struct RouteEntry {
+    std::list<std::string> allowedMethods;
+    std::string content;
+    bool isFile;
+    std::string uploadDirectory = "";  // multipart/form-data bodies are streamed into this directory
+    bool immutable = false;            // Fingerprinted URL, its content can never change
+    std::shared_ptr<const CorsPolicy> cors;       // Cross-origin policy, none for same-origin only
+    std::map<std::string, Preflight> preflights;  // Rendered from `cors` by admitted origin ("*" for any)
+    RouteHandler handler;                         // Produces the response instead of `content` when set
+    bool offload = false;                         // Run `handler` on the handler pool, off the event loop
+    size_t maxUploadSize = MAX_UPLOAD_SIZE;       // Larger upload bodies are refused with 413
+    UploadSinkFactory uploadSink;                 // Takes the parts as they are parsed, instead of `uploadDirectory`
+    bool keepUploads = false;                     // Leave spooled files in place once the request is answered
+};
+
+// Quiescent-state-based reclamation for data that event loops read without locks
+// or reference counts. A reader is online for a whole event-loop iteration and
+// goes offline around epoll_wait, where it holds no pointers into shared data.
+// Writers publish a replacement with an atomic exchange and retire the old
+// object, which is freed once every online reader has come back from a
+// quiescent point reached after the retirement.
+class Qsbr {
+public:
+    ~Qsbr() {
+        for (auto& retired : retiredObjects) {
+            retired.free();
+        }
+    }
+
+    // Claims a reader slot for the calling thread and puts it online. Returns -1
+    // if all slots are taken.
+    int registerReader() {
+        for (int slot = 0; slot < MAX_QSBR_READERS; ++slot) {
+            bool expected = false;
+            if (readers[slot].used.compare_exchange_strong(expected, true)) {
+                online(slot);
+                return slot;
+            }
+        }
+        log("ERROR", "Qsbr", "registerReader", "No free reader slot", "Max: " + std::to_string(MAX_QSBR_READERS));
+        return -1;
+    }
+
+    void unregisterReader(int slot) {
+        offline(slot);
+        readers[slot].used = false;
+    }
+
+    // Pointers to shared data may be loaded from here on...
+    void online(int slot) {
+        readers[slot].seen.store(epoch.load());
+    }
+
+    // ...and are not used any more from here on.
+    void offline(int slot) {
+        readers[slot].seen.store(QSBR_OFFLINE);
+    }
+
+    // Frees `object` once no reader can still be using it.
+    template <typename T>
+    void retire(const T* object) {
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        retiredObjects.push_back({epoch.fetch_add(1) + 1, [object] { delete object; }});
+    }
+
+    // Frees the retired objects every online reader has moved past. Returns how many.
+    size_t reclaim() {
+        uint64_t oldest = UINT64_MAX;
+        for (const auto& reader : readers) {
+            uint64_t seen = reader.seen.load();
+            if (seen != QSBR_OFFLINE) {
+                oldest = std::min(oldest, seen);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(retiredMutex);
+        size_t freed = 0;
+        for (auto it = retiredObjects.begin(); it != retiredObjects.end();) {
+            if (it->epoch <= oldest) {
+                it->free();
+                it = retiredObjects.erase(it);
+                ++freed;
+            } else {
+                ++it;
+            }
+        }
+        return freed;
+    }
+
+private:
+    struct alignas(64) Reader {         // One cache line each, readers never share one
+        std::atomic<uint64_t> seen{QSBR_OFFLINE};   // Epoch observed when last coming online
+        std::atomic<bool> used{false};
+    };
+    struct Retired {
+        uint64_t epoch;
+        std::function<void()> free;
+    };
+
+    Reader readers[MAX_QSBR_READERS];
+    std::atomic<uint64_t> epoch{1};
+    std::mutex retiredMutex;
+    std::vector<Retired> retiredObjects;
+};
+
+// Everything requests are routed and answered from. A published table is never
+// modified: reloading builds a new one and retires the old.
+struct RouteTable {
+    std::map<std::string, RouteEntry, std::less<>> routes;
+    AssetCache assets;
+};
+
+class RequestHandler {
+public:
+    RequestHandler() : table(new RouteTable()) {}
+
+    ~RequestHandler() {
+        stopLoading = true;
+        std::lock_guard<std::mutex> lock(loaderMutex);
+        if (assetLoader.joinable()) {
+            assetLoader.join();
+        }
+        delete table.load();
+    }
+
+    RequestHandler(const RequestHandler&) = delete;
+    RequestHandler& operator=(const RequestHandler&) = delete;
+
+    // Event loops register here as readers of the route table.
+    Qsbr& readers() {
+        return qsbr;
+    }
+
+    // Adds or replaces a route. Routes take effect at the next publishRoutes(),
+    // which HttpServer::start() calls.
+    void addRoute(const std::string& path, const RouteEntry& route) {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        configuredRoutes[path] = route;
+    }
+
+    // Answers `methods` on `path` by calling `handler` on the event-loop thread
+    // that received the request, or on a handler-pool thread if `offload` is set
+    // and the server has a pool (see HttpServer::setHandlerThreads).
+    void addHandler(const std::string& path, const std::list<std::string>& methods, RouteHandler handler, bool offload = false) {
+        RouteEntry route = {methods, "", false};
+        route.handler = std::move(handler);
+        route.offload = offload;
+        std::lock_guard<std::mutex> lock(publishMutex);
+        configuredRoutes[path] = route;
+    }
+
+    // Renders CORS preflights and loads file routes into the asset cache, then
+    // swaps the result in for requests that arrive from now on. Returns once the
+    // warm fraction of files is cached (see setWarmFraction); the rest keep
+    // loading in the background. Not to be called concurrently with itself.
+    void publishRoutes() {
+        std::lock_guard<std::mutex> loader(loaderMutex);
+        if (assetLoader.joinable()) {
+            assetLoader.join();
+        }
+        std::unique_lock<std::mutex> lock(publishMutex);
+        renderPreflights();
+        if (warmFraction >= 1.0) {
+            loadAssets();
+            return;
+        }
+
+        warmTable = false;
+        loadingAssets = true;
+        lock.unlock();
+        assetLoader = std::thread([this] {
+            std::lock_guard<std::mutex> lock(publishMutex);
+            loadAssets(warmFraction);
+            loadingAssets = false;
+        });
+        std::unique_lock<std::mutex> warm(loadMutex);
+        loadProgress.wait(warm, [this] { return warmTable; });
+    }
+
+    // Threads that read, minify and hash files in publishRoutes(). 0 (the
+    // default) uses one per core.
+    void setAssetThreads(size_t threads) {
+        assetThreads = threads;
+    }
+
+    // Fraction of the files behind file routes that publishRoutes() waits to
+    // have cached. Below 1 the others are loaded in the background and served
+    // from disk until they are, so 0 makes it return at once.
+    void setWarmFraction(double fraction) {
+        warmFraction = std::clamp(fraction, 0.0, 1.0);
+    }
+
+    // Pre-rendered answer to a CORS preflight, or null if this is not a preflight
+    // for a route whose policy admits the request's origin.
+    std::shared_ptr<const std::string> preflightResponse(const Request& request, bool keepAlive) const {
+        if (request.method != "OPTIONS" || findHeader(request.headers, "Access-Control-Request-Method").empty()) {
+            return nullptr;
+        }
+        const RouteTable* current = table.load();
+        auto route = current->routes.find(request.path);
+        if (route == current->routes.end() || !route->second.cors) {
+            return nullptr;
+        }
+        std::string allowed = route->second.cors->allowOrigin(findHeader(request.headers, "Origin"));
+        auto preflight = route->second.preflights.find(allowed);
+        if (allowed.empty() || preflight == route->second.preflights.end()) {
+            return nullptr;
+        }
+        return keepAlive ? preflight->second.response : preflight->second.closeResponse;
+    }
+
+    // Serve HTML and CSS minified, from the next publishRoutes() on. The minified
+    // bytes replace the originals as the cached representation, so hashes and
+    // ETags are computed over them.
+    void setMinify(bool enabled) {
+        minify = enabled;
+    }
+
+    // Bumped whenever a new route table is published; responses cached outside
+    // the table are only valid for the generation they were built from.
+    uint64_t generation() const {
+        return tableGeneration.load();
+    }
+
+    // Checks on the asset loader thread whether any cached file changed on disk
+    // and if so rebuilds assets and fingerprinted routes there, publishing the new
+    // table like publishRoutes() does. Returns at once; does nothing while a load
+    // or an earlier check is still running.
+    void reloadChangedAssets() {
+        std::unique_lock<std::mutex> loader(loaderMutex, std::try_to_lock);
+        if (!loader.owns_lock() || loadingAssets) {
+            return;
+        }
+        if (assetLoader.joinable()) {
+            assetLoader.join();
+        }
+        loadingAssets = true;
+        assetLoader = std::thread([this] {
+            // Only writers retire tables, so the current one stays valid under publishMutex
+            std::lock_guard<std::mutex> lock(publishMutex);
+            if (table.load()->assets.changedOnDisk()) {
+                log("INFO", "RequestHandler", "reloadChangedAssets", "Assets changed on disk", "Reloading");
+                loadAssets();
+            }
+            loadingAssets = false;
+        });
+    }
+
+    // True if the request goes to an offloaded handler.
+    bool offloaded(const Request& request) const {
+        const RouteTable* current = table.load();
+        auto route = current->routes.find(request.path);
+        if (route == current->routes.end() || !route->second.offload) {
+            return false;
+        }
+        const auto& allowedMethods = route->second.allowedMethods;
+        return std::find(allowedMethods.begin(), allowedMethods.end(), request.method) != allowedMethods.end();
+    }
+
+    // Route streaming uploads for `method` to `path`, null if there is none (the
+    // body is then buffered like any other). Valid until the caller's next
+    // quiescent point.
+    const RouteEntry* uploadRoute(std::string_view method, std::string_view path) const {
+        const RouteTable* current = table.load();
+        auto route = current->routes.find(path);
+        if (route == current->routes.end() || (route->second.uploadDirectory.empty() && !route->second.uploadSink)) {
+            return nullptr;
+        }
+        const auto& allowedMethods = route->second.allowedMethods;
+        if (std::find(allowedMethods.begin(), allowedMethods.end(), method) == allowedMethods.end()) {
+            return nullptr;
+        }
+        return &route->second;
+    }
+
+    Response handleRequest(const Request& request) {
+        const RouteTable* current = table.load();
+        auto route = current->routes.find(request.path);
+        if (route == current->routes.end()) {
+            log("ERROR", "handleRequest", "Route not found", "No route for", std::string(request.path));
+            return {STATUS_NOT_FOUND, "<html><body>404 Route Not Found: " + std::string(request.target) + "</body></html>", "text/html"};
+        }
+
+        const auto& allowedMethods = route->second.allowedMethods;
+        if (std::find(allowedMethods.begin(), allowedMethods.end(), request.method) == allowedMethods.end()) {
+            std::string allowed;
+            for (const auto& method : allowedMethods) {
+                allowed += method + " ";
+            }
+            log("ERROR", "handleRequest", "Method not allowed", "Method: " + request.method + " not allowed for", std::string(request.path));
+            return {STATUS_METHOD_NOT_ALLOWED, "<html><body>405 Method Not Allowed: " + request.method + " not allowed for " + std::string(request.target) + ". Allowed methods: " + allowed + "</body></html>", "text/html"};
+        }
+
+        Response response = routeResponse(request, route->second, current->assets);
+        if (route->second.cors) {
+            std::string allowed = route->second.cors->allowOrigin(findHeader(request.headers, "Origin"));
+            if (!allowed.empty()) {
+                response.headers.emplace_back("Access-Control-Allow-Origin", allowed);
+            }
+            if (allowed != "*") {
+                response.headers.emplace_back("Vary", "Origin");
+            }
+        }
+        return response;
+    }
+
+private:
+    Response routeResponse(const Request& request, const RouteEntry& route, const AssetCache& assets) {
+        if (route.handler) {
+            return route.handler(request);
+        }
+        if (route.isFile) {
+            if (const Asset* asset = assets.find(route.content)) {
+                return assetResponse(request, route, *asset);
+            }
+
+            // The file is handed to the connection as a file segment and sent with sendfile
+            int fd = open(route.content.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat fileStat;
+            if (fd == -1 || fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode)) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                log("ERROR", "handleRequest", "File not found", "Failed to open", route.content);
+                return {STATUS_NOT_FOUND, "<html><body>404 Resource Not Found: " + std::string(request.target) + "</body></html>", "text/html"};
+            }
+            std::string contentType = getContentType(route.content);
+            log("INFO", "handleRequest", "File served", "Serving content from", route.content);
+            Response response = {STATUS_SUCCESS, "", contentType};
+            response.fileFd = fd;
+            response.fileSize = fileStat.st_size;
+            return response;
+        } else {
+            return {STATUS_SUCCESS, route.content, "text/html"};
+        }
+    }
+
+    // Serializes every preflight response once, so OPTIONS requests are answered
+    // with bytes that already exist and no handler runs for them.
+    void renderPreflights() {
+        for (auto& route : configuredRoutes) {
+            const auto& cors = route.second.cors;
+            if (!cors) {
+                continue;
+            }
+            std::string methods;
+            for (const auto& method : route.second.allowedMethods) {
+                methods += method + ", ";
+            }
+            methods += "OPTIONS";
+
+            route.second.preflights.clear();
+            for (const auto& origin : cors->allowedOrigins) {
+                Response response = {STATUS_NO_CONTENT, "", ""};
+                response.headers = {
+                    {"Access-Control-Allow-Origin", origin},
+                    {"Access-Control-Allow-Methods", methods},
+                    {"Access-Control-Allow-Headers", cors->allowedHeaders},
+                    {"Access-Control-Max-Age", std::to_string(cors->maxAge)},
+                };
+                if (origin != "*") {
+                    response.headers.emplace_back("Vary", "Origin");
+                }
+                Preflight preflight;
+                preflight.response = trackedString(MEMORY_PREFLIGHTS, response.buildHeader(true));
+                preflight.closeResponse = trackedString(MEMORY_PREFLIGHTS, response.buildHeader(false));
+                route.second.preflights[origin] = preflight;
+            }
+            log("INFO", "RequestHandler", "renderPreflights", "CORS preflight rendered", route.first + " (" + methods + ")");
+        }
+    }
+
+    // One file route's file, read and transformed by a loader thread.
+    struct AssetJob {
+        std::string path;
+        bool html;
+        bool done = false;                       // Set under loadMutex once the fields below are final
+        std::shared_ptr<const std::string> content;   // Null if the file is served from disk
+        std::string hash;
+        size_t sourceSize = 0;
+        struct timespec modified = {};
+    };
+
+    // Loads every file route into the asset cache. Static assets get an extra,
+    // fingerprinted route served as immutable; HTML has its references to them
+    // rewritten to the fingerprinted URLs before it is hashed itself. Files are
+    // read, minified and hashed by a pool of threads, static assets first since
+    // HTML needs their fingerprints. Requests keep reading the old table until a
+    // new one is swapped in: once `warmFraction` of the files are cached (serving
+    // the rest from disk) and again when all of them are.
+    void loadAssets(double warmFraction = 1.0) {
+        auto began = std::chrono::steady_clock::now();
+        std::vector<AssetJob> jobs;
+        for (const auto& route : configuredRoutes) {
+            const std::string& path = route.second.content;
+            if (route.second.isFile && std::none_of(jobs.begin(), jobs.end(), [&](const AssetJob& job) { return job.path == path; })) {
+                jobs.push_back({path, getContentType(path) == "text/html"});
+            }
+        }
+        std::stable_partition(jobs.begin(), jobs.end(), [](const AssetJob& job) { return !job.html; });
+        size_t staticCount = std::count_if(jobs.begin(), jobs.end(), [](const AssetJob& job) { return !job.html; });
+        size_t warmFiles = std::min(jobs.size(), static_cast<size_t>(std::ceil(warmFraction * jobs.size())));
+        size_t threads = std::max<size_t>(1, std::min(assetThreads ? assetThreads : std::thread::hardware_concurrency(), jobs.size()));
+        loadedJobs = 0;
+
+        bool warm = false;
+        auto publishWarm = [&](size_t end) {
+            if (warm || warmFiles > end || warmFiles == jobs.size()) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(loadMutex);
+            loadProgress.wait(lock, [&] { return loadedJobs >= warmFiles; });
+            std::map<std::string, std::string> fingerprinted;
+            auto next = buildTable(jobs, fingerprinted);
+            lock.unlock();
+            publishTable(std::move(next));
+            warm = true;
+            log("INFO", "RequestHandler", "loadAssets", "Warm", std::to_string(loadedJobs) + " of " + std::to_string(jobs.size())
+                + " files after " + std::to_string(millisecondsSince(began)) + " ms, the rest served from disk until loaded");
+            signalWarm();
+        };
+
+        publishWarm(0);
+        std::map<std::string, std::string> fingerprinted;
+        runJobs(jobs, 0, staticCount, threads, fingerprinted, [&] { publishWarm(staticCount); });
+        auto staticDone = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(loadMutex);
+            buildTable(jobs, fingerprinted);   // Only for the fingerprints HTML refers to
+        }
+        runJobs(jobs, staticCount, jobs.size(), threads, fingerprinted, [&] { publishWarm(jobs.size()); });
+
+        std::unique_ptr<RouteTable> next;
+        {
+            std::lock_guard<std::mutex> lock(loadMutex);
+            next = buildTable(jobs, fingerprinted);
+        }
+        for (const auto& url : fingerprinted) {
+            log("INFO", "RequestHandler", "loadAssets", "Fingerprinted", url.first + " -> " + url.second);
+        }
+        publishTable(std::move(next));
+        log("INFO", "RequestHandler", "loadAssets", "Assets loaded", std::to_string(jobs.size()) + " files on "
+            + std::to_string(threads) + " threads in " + std::to_string(millisecondsSince(began)) + " ms (static "
+            + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(staticDone - began).count()) + " ms, HTML "
+            + std::to_string(millisecondsSince(staticDone)) + " ms)");
+        signalWarm();
+    }
+
+    // Runs jobs [begin, end) on `threads` threads pulling the next file off a
+    // shared index, calling `meanwhile` on this one before waiting for them.
+    void runJobs(std::vector<AssetJob>& jobs, size_t begin, size_t end, size_t threads,
+                 const std::map<std::string, std::string>& fingerprinted, const std::function<void()>& meanwhile) {
+        std::atomic<size_t> next{begin};
+        auto work = [&] {
+            for (size_t i = next++; i < end; i = next++) {
+                loadJob(jobs[i], fingerprinted);
+                std::lock_guard<std::mutex> lock(loadMutex);
+                jobs[i].done = true;
+                ++loadedJobs;
+                loadProgress.notify_all();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < std::min(threads, end - begin); ++i) {
+            workers.emplace_back(work);
+        }
+        meanwhile();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void loadJob(AssetJob& job, const std::map<std::string, std::string>& fingerprinted) {
+        std::string content;
+        if (stopLoading || !readAssetFile(job.path, content, job.modified)) {
+            return;
+        }
+        job.sourceSize = content.size();
+        if (job.html) {
+            content = rewriteReferences(std::move(content), fingerprinted);
+        }
+        if (minify && (job.html || getContentType(job.path) == "text/css")) {
+            content = minified(job.path, std::move(content), job.html ? minifyHtml : minifyCss);
+        }
+        job.hash = contentHash(content);
+        job.content = trackedString(MEMORY_ASSET_CACHE, std::move(content));
+        log("INFO", "RequestHandler", "loadJob", "Asset loaded", job.path + " (" + job.hash + ")");
+    }
+
+    // Route table with the jobs done so far cached and fingerprinted. Sets
+    // `fingerprinted` to the URLs they got. Must hold loadMutex.
+    std::unique_ptr<RouteTable> buildTable(const std::vector<AssetJob>& jobs, std::map<std::string, std::string>& fingerprinted) {
+        auto next = std::make_unique<RouteTable>();
+        next->routes = configuredRoutes;
+        for (const auto& job : jobs) {
+            if (job.done && job.content) {
+                next->assets.store(job.path, job.content, job.hash, job.sourceSize, job.modified);
+            }
+        }
+        fingerprinted.clear();
+        for (const auto& route : configuredRoutes) {
+            const Asset* asset = route.second.isFile ? next->assets.find(route.second.content) : nullptr;
+            if (!asset || asset->contentType == "text/html") {
+                continue;
+            }
+            std::string url = fingerprintUrl(route.first, asset->hash);
+            RouteEntry entry = {{"GET"}, route.second.content, true};
+            entry.immutable = true;
+            next->routes[url] = entry;
+            fingerprinted[route.first] = url;
+        }
+        return next;
+    }
+
+    void publishTable(std::unique_ptr<RouteTable> next) {
+        qsbr.retire(table.exchange(next.release()));
+        ++tableGeneration;
+        qsbr.reclaim();
+    }
+
+    void signalWarm() {
+        std::lock_guard<std::mutex> lock(loadMutex);
+        warmTable = true;
+        loadProgress.notify_all();
+    }
+
+    static long millisecondsSince(std::chrono::steady_clock::time_point from) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - from).count();
+    }
+
+    static std::string minified(const std::string& path, std::string content, std::string (*minifier)(std::string_view)) {
+        std::string result = minifier(content);
+        log("INFO", "RequestHandler", "minified", "Minified", path + ": " + std::to_string(content.size()) + " -> "
+            + std::to_string(result.size()) + " bytes, saved " + std::to_string(content.size() - result.size()));
+        return result;
+    }
+
+    // Points quoted attribute values that name a fingerprinted asset at its new URL.
+    static std::string rewriteReferences(std::string html, const std::map<std::string, std::string>& fingerprinted) {
+        for (const auto& reference : fingerprinted) {
+            for (char quote : {'"', '\''}) {
+                std::string from = "=" + std::string(1, quote) + reference.first + quote;
+                std::string to = "=" + std::string(1, quote) + reference.second + quote;
+                for (size_t pos = html.find(from); pos != std::string::npos; pos = html.find(from, pos + to.size())) {
+                    html.replace(pos, from.size(), to);
+                }
+            }
+        }
+        return html;
+    }
+
+    Response assetResponse(const Request& request, const RouteEntry& route, const Asset& asset) {
+        Response response = {STATUS_SUCCESS, "", asset.contentType};
+        response.headers.emplace_back("ETag", asset.etag);
+        response.headers.emplace_back("Cache-Control", route.immutable ? IMMUTABLE_CACHE_CONTROL : "no-cache");
+        if (findHeader(request.headers, "If-None-Match") == asset.etag) {
+            response.code = STATUS_NOT_MODIFIED;
+            return response;
+        }
+        response.sharedBody = asset.content;
+        response.shareable = !route.cors;
+        log("INFO", "handleRequest", "File served", "Serving cached content from", route.content);
+        return response;
+    }
+
+    std::atomic<const RouteTable*> table;   // Read with a plain load, protected by qsbr
+    std::atomic<uint64_t> tableGeneration{1};
+    Qsbr qsbr;
+    std::map<std::string, RouteEntry, std::less<>> configuredRoutes;   // Published table without fingerprinted routes
+    std::mutex publishMutex;                 // Serializes writers only
+    bool minify = false;
+    size_t assetThreads = 0;
+    double warmFraction = 1.0;
+    std::thread assetLoader;                 // Finishes loading after publishRoutes() returned warm, and reloads
+    std::mutex loaderMutex;                  // Guards assetLoader
+    std::atomic<bool> loadingAssets{false};
+    std::atomic<bool> stopLoading{false};
+    std::mutex loadMutex;                    // Guards job progress and warmTable
+    std::condition_variable loadProgress;
+    size_t loadedJobs = 0;
+    bool warmTable = false;
+};
+
+// One pending piece of output: either an owned buffer or a byte range of an open file.
+struct SendSegment {
+    std::string data;
+    std::string_view staticData;        // Used instead of `data` for bytes owned elsewhere
+    std::shared_ptr<const std::string> owner;   // Keeps cached bytes behind staticData alive
+    size_t sent = 0;
+    int fileFd = -1;
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0;
+
+    bool isFile() const {
+        return fileFd >= 0;
+    }
+
+    const char* bytes() const {
+        return staticData.empty() ? data.data() : staticData.data();
+    }
+
+    size_t remaining() const {
+        return isFile() ? fileRemaining : (staticData.empty() ? data.size() : staticData.size()) - sent;
+    }
+};
+
+// A fixed endpoint answered from pre-serialized bytes, matched on the raw request
+// line before any header parsing and never access-logged.
+struct FastPath {
+    std::string requestLine;            // e.g. "GET /healthz HTTP/1.1\r\n"
+    std::string response;               // Complete response, keep-alive
+    std::string closeResponse;          // Same response with "Connection: close"
+};
+
+// Where HttpServer listens:
+//   "0.0.0.0:8080"          IPv4
+//   "[::]:8080"             IPv6, dual-stack so IPv4 clients are accepted too
+//   "unix:/run/chip.sock"   Unix domain socket on the filesystem
+//   "unix:@chipport"        Unix domain socket in the abstract namespace
+struct ListenAddress {
+    std::string spec;
+    bool proxyProtocol = false;     // Every accepted connection starts with a PROXY v1/v2 header
+    bool admin = false;             // Priority lane: served first, never shed, may reach /admin/ routes
+};
+
+struct Listener {
+    ListenAddress address;
+    int fd = -1;
+    std::atomic<unsigned long> accepted{0};     // Connections accepted since start
+    std::atomic<unsigned long> active{0};       // Connections currently open
+};
+
+// Turns a listen spec into a socket address. Returns false if it cannot be parsed.
+inline bool resolveListenAddress(const std::string& spec, struct sockaddr_storage& storage, socklen_t& length) {
+    storage = {};
+    if (spec.compare(0, 5, "unix:") == 0) {
+        auto* unixAddress = reinterpret_cast<struct sockaddr_un*>(&storage);
+        std::string path = spec.substr(5);
+        if (path.empty() || path.size() >= sizeof(unixAddress->sun_path)) {
+            return false;
+        }
+        unixAddress->sun_family = AF_UNIX;
+        memcpy(unixAddress->sun_path, path.data(), path.size());
+        if (path[0] == '@') {
+            unixAddress->sun_path[0] = '\0';    // Abstract namespace, not NUL-terminated
+            length = offsetof(struct sockaddr_un, sun_path) + path.size();
+        } else {
+            length = sizeof(struct sockaddr_un);
+        }
+        return true;
+    }
+
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    std::string host = spec.substr(0, colon);
+    char* end = nullptr;
+    long port = strtol(spec.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port < 0 || port > 65535) {
+        return false;
+    }
+
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        auto* ipv6 = reinterpret_cast<struct sockaddr_in6*>(&storage);
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = htons(port);
+        length = sizeof(struct sockaddr_in6);
+        return inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &ipv6->sin6_addr) == 1;
+    }
+    auto* ipv4 = reinterpret_cast<struct sockaddr_in*>(&storage);
+    ipv4->sin_family = AF_INET;
+    ipv4->sin_port = htons(port);
+    length = sizeof(struct sockaddr_in);
+    return inet_pton(AF_INET, host.empty() ? "0.0.0.0" : host.c_str(), &ipv4->sin_addr) == 1;
+}
+
+enum class ProxyHeaderResult { Incomplete, Parsed, Invalid };
+
+// Parses a PROXY protocol v1 or v2 header at the start of `input` in place.
+// On success `consumed` is the header length and `clientAddress` the original
+// client ("" for LOCAL/UNKNOWN connections, where the socket peer is kept).
+inline ProxyHeaderResult parseProxyHeader(const std::string& input, size_t& consumed, std::string& clientAddress) {
+    static const char v2Signature[12] = {'\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n'};
+    static const char v1Prefix[] = "PROXY ";
+
+    size_t available = std::min(input.size(), sizeof(v2Signature));
+    if (memcmp(input.data(), v2Signature, available) == 0) {
+        if (input.size() < PROXY_V2_HEADER_LENGTH) {
+            return ProxyHeaderResult::Incomplete;
+        }
+        const unsigned char* header = reinterpret_cast<const unsigned char*>(input.data());
+        size_t length = (header[14] << 8) | header[15];
+        if (input.size() < PROXY_V2_HEADER_LENGTH + length) {
+            return ProxyHeaderResult::Incomplete;
+        }
+        if ((header[12] & 0xF0) != 0x20) {
+            return ProxyHeaderResult::Invalid;
+        }
+        consumed = PROXY_V2_HEADER_LENGTH + length;
+        clientAddress.clear();
+        if ((header[12] & 0x0F) == 0x00) {
+            return ProxyHeaderResult::Parsed;      // LOCAL: health check from the balancer itself
+        }
+        if ((header[12] & 0x0F) != 0x01) {
+            return ProxyHeaderResult::Invalid;
+        }
+
+        const unsigned char* addresses = header + PROXY_V2_HEADER_LENGTH;
+        struct sockaddr_storage source = {};
+        if (header[13] >> 4 == 0x1 && length >= 12) {
+            auto* ipv4 = reinterpret_cast<struct sockaddr_in*>(&source);
+            ipv4->sin_family = AF_INET;
+            memcpy(&ipv4->sin_addr, addresses, 4);
+            memcpy(&ipv4->sin_port, addresses + 8, 2);
+        } else if (header[13] >> 4 == 0x2 && length >= 36) {
+            auto* ipv6 = reinterpret_cast<struct sockaddr_in6*>(&source);
+            ipv6->sin6_family = AF_INET6;
+            memcpy(&ipv6->sin6_addr, addresses, 16);
+            memcpy(&ipv6->sin6_port, addresses + 32, 2);
+        } else {
+            return ProxyHeaderResult::Parsed;      // AF_UNIX or unspecified, nothing useful to report
+        }
+        clientAddress = formatAddress(reinterpret_cast<struct sockaddr*>(&source));
+        return ProxyHeaderResult::Parsed;
+    }
+
+    available = std::min(input.size(), sizeof(v1Prefix) - 1);
+    if (memcmp(input.data(), v1Prefix, available) != 0) {
+        return ProxyHeaderResult::Invalid;
+    }
+    size_t lineEnd = input.find("\r\n");
+    if (lineEnd == std::string::npos) {
+        return input.size() > PROXY_V1_MAX_LENGTH ? ProxyHeaderResult::Invalid : ProxyHeaderResult::Incomplete;
+    }
+    if (lineEnd + 2 > PROXY_V1_MAX_LENGTH) {
+        return ProxyHeaderResult::Invalid;
+    }
+
+    // PROXY TCP4|TCP6 <source> <destination> <source port> <destination port>
+    std::istringstream line(input.substr(sizeof(v1Prefix) - 1, lineEnd - sizeof(v1Prefix) + 1));
+    std::string protocol, source, destination, sourcePort;
+    line >> protocol;
+    consumed = lineEnd + 2;
+    clientAddress.clear();
+    if (protocol == "UNKNOWN") {
+        return ProxyHeaderResult::Parsed;
+    }
+    if (!(line >> source >> destination >> sourcePort) || (protocol != "TCP4" && protocol != "TCP6")) {
+        return ProxyHeaderResult::Invalid;
+    }
+    clientAddress = protocol == "TCP6" ? "[" + source + "]:" + sourcePort : source + ":" + sourcePort;
+    return ProxyHeaderResult::Parsed;
+}
+
+// Moves a connection's bytes. Connections accepted from listeners use sockets;
+// the loopback transport keeps both directions in memory so the request pipeline
+// can be driven and measured without any syscalls.
+class Transport {
+public:
+    virtual ~Transport() = default;
+    // Same contracts as read, sendmsg and sendfile, including -1 with EAGAIN
+    virtual ssize_t receive(int fd, char* buffer, size_t length) = 0;
+    virtual ssize_t send(int fd, const struct iovec* iov, int count) = 0;
+    virtual ssize_t sendFile(int fd, int fileFd, off_t* offset, size_t length) = 0;
+    virtual void release(int fd) = 0;
+};
+
+class SocketTransport : public Transport {
+public:
+    ssize_t receive(int fd, char* buffer, size_t length) override {
+        return read(fd, buffer, length);
+    }
+
+    ssize_t send(int fd, const struct iovec* iov, int count) override {
+        struct msghdr message = {};
+        message.msg_iov = const_cast<struct iovec*>(iov);
+        message.msg_iovlen = count;
+        return sendmsg(fd, &message, MSG_NOSIGNAL);
+    }
+
+    ssize_t sendFile(int fd, int fileFd, off_t* offset, size_t length) override {
+        return sendfile(fd, fileFd, offset, length);
+    }
+
+    void release(int fd) override {
+        close(fd);
+    }
+};
+
+// In-memory connections: the client side pushes request bytes and collects
+// whatever the server wrote. Ids are negative so they never collide with fds.
+class LoopbackTransport : public Transport {
+public:
+    int open() {
+        int id = nextId--;
+        streams[id];
+        return id;
+    }
+
+    void push(int id, std::string_view data) {
+        streams[id].input.append(data);
+    }
+
+    // Everything the server sent so far; the caller may clear it between batches.
+    std::string& output(int id) {
+        return streams[id].output;
+    }
+
+    ssize_t receive(int fd, char* buffer, size_t length) override {
+        Stream& stream = streams[fd];
+        if (stream.readOffset == stream.input.size()) {
+            errno = EAGAIN;
+            return -1;
+        }
+        size_t count = std::min(length, stream.input.size() - stream.readOffset);
+        memcpy(buffer, stream.input.data() + stream.readOffset, count);
+        stream.readOffset += count;
+        if (stream.readOffset == stream.input.size()) {
+            stream.input.clear();
+            stream.readOffset = 0;
+        }
+        return count;
+    }
+
+    ssize_t send(int fd, const struct iovec* iov, int count) override {
+        std::string& output = streams[fd].output;
+        size_t total = 0;
+        for (int i = 0; i < count; ++i) {
+            output.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+            total += iov[i].iov_len;
+        }
+        return total;
+    }
+
+    ssize_t sendFile(int fd, int fileFd, off_t* offset, size_t length) override {
+        std::string& output = streams[fd].output;
+        size_t start = output.size();
+        output.resize(start + length);
+        ssize_t count = pread(fileFd, &output[start], length, *offset);
+        output.resize(start + std::max<ssize_t>(count, 0));
+        if (count > 0) {
+            *offset += count;
+        }
+        return count;
+    }
+
+    void release(int fd) override {
+        streams.erase(fd);
+    }
+
+private:
+    struct Stream {
+        std::string input;
+        size_t readOffset = 0;
+        std::string output;
+    };
+    std::unordered_map<int, Stream> streams;
+    int nextId = -2;
+};
+
+// A multipart request whose body is being streamed through the parser.
+struct Upload {
+    std::unique_ptr<Request> request;   // Parsed from the head only
+    std::shared_ptr<MultipartSink> sink;
+    UploadSpooler* spooler = nullptr;   // `sink`, unless the route brought its own
+    std::unique_ptr<MultipartParser> parser;
+    size_t remaining;                   // Body bytes still to come
+};
+
+struct EventLoop;
+
+// What a connection's deadline is for.
+enum class ConnectionWait { None, Idle, Header, Body };
+
+struct Connection {
+    int fd;
+    Transport* transport;
+    EventLoop* loop = nullptr;          // The loop that owns it; only that thread touches it
+    uint64_t id = 0;                    // Unique for the server's lifetime, unlike fd
+    std::string input;                  // Received bytes not yet parsed into requests
+    std::unique_ptr<Upload> upload;
+    bool bodyChecked = false;           // Head of the buffered request was already checked for an upload
+    std::string peerAddress;
+    bool awaitingProxyHeader = false;   // Listener expects a PROXY header before the first request
+    Listener* listener = nullptr;
+    bool priority = false;              // Accepted on an admin listener
+    std::deque<SendSegment> sendQueue;
+    size_t queuedBytes = 0;
+    bool readPaused = false;            // Set while queuedBytes is above the high watermark
+    bool handlerPending = false;        // A request is out on the handler pool; later ones wait
+    bool peerClosed = false;
+    bool closeAfterFlush = false;
+    bool lingerOnClose = false;         // Input may still be arriving; drain it rather than reset the peer
+    bool lingering = false;             // Writes shut down, discarding input until EOF or the deadline
+    size_t lingerBudget = 0;            // Input bytes still discarded before closing anyway
+    ConnectionWait waiting = ConnectionWait::Idle;   // Nothing to wait for while the server owes a response
+    std::chrono::steady_clock::time_point deadline;  // When `waiting` runs out
+    std::chrono::steady_clock::time_point bodyStarted;
+    uint64_t receivedBytes = 0;         // Read from the socket in total
+    uint64_t bodyMark = 0;              // receivedBytes when the body wait began
+    bool flushScheduled = false;        // Already on the end-of-iteration flush list
+    bool ready = false;                 // On the loop's ready list, having run out of budget
+    bool tunedBuffers = false;          // Eligible for socket tuning, see LARGE_SOCKET_BUFFER
+    bool largeSendBuffer = false;       // Tuned for large responses already
+    uint64_t budgetIteration = 0;       // Loop iteration the budgets below were granted for
+    size_t readBudget = 0;
+    size_t requestBudget = 0;
+    size_t writeBudget = 0;
+    int64_t accountedBytes = 0;         // Last figure added to MEMORY_CONNECTIONS
+
+    Connection(int fd, Transport* transport, const std::string& peerAddress) : fd(fd), transport(transport), peerAddress(peerAddress) {
+        account();
+    }
+
+    // Brings the connection's share of MEMORY_CONNECTIONS up to date.
+    void account() {
+        int64_t bytes = sizeof(Connection) + input.capacity() + peerAddress.capacity();
+        for (const auto& segment : sendQueue) {
+            bytes += sizeof(SendSegment) + segment.data.capacity();
+        }
+        if (upload) {
+            bytes += sizeof(Upload) + sizeof(UploadSpooler) + sizeof(MultipartParser) + sizeof(Request) + upload->request->raw.capacity();
+        }
+        MemoryAccount::add(MEMORY_CONNECTIONS, bytes - accountedBytes);
+        accountedBytes = bytes;
+    }
+
+    ~Connection() {
+        MemoryAccount::add(MEMORY_CONNECTIONS, -accountedBytes);
+        for (auto& segment : sendQueue) {
+            if (segment.isFile()) {
+                close(segment.fileFd);
+            }
+        }
+        transport->release(fd);
+    }
+};
+
+// Bounded lock-free queue for many producer threads and one consumer (a ring of
+// sequenced cells, after Vyukov). A push costs one compare-and-swap on the tail.
+// It reports whether the consumer had already taken everything before it, which
+// is the only case where the consumer needs waking; the consumer closes the
+// remaining gap in finishBatch().
+template <typename T>
+class MpscQueue {
+public:
+    // `capacity` must be a power of two.
+    explicit MpscQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1) {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Any thread. Returns false if the queue is full.
+    bool push(T value, bool& wasEmpty) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        wasEmpty = consumed.load() == position;
+        return true;
+    }
+
+    // Consumer only. Returns false if nothing is ready.
+    bool pop(T& value) {
+        Cell* cell = &cells[head & mask];
+        if (cell->sequence.load(std::memory_order_acquire) != head + 1) {
+            return false;
+        }
+        value = std::move(cell->value);
+        cell->value = T();
+        cell->sequence.store(head + mask + 1, std::memory_order_release);
+        ++head;
+        return true;
+    }
+
+    // Consumer only, after each batch. Returns true if messages remain that no
+    // producer will signal for: left over from the batch, or still being written.
+    bool finishBatch() {
+        consumed.store(head);
+        return tail.load() != head;
+    }
+
+    // Bytes taken by the ring itself.
+    size_t footprint() const {
+        return (mask + 1) * sizeof(Cell);
+    }
+
+private:
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> tail{0};        // Next position producers claim
+    alignas(64) std::atomic<size_t> consumed{0};    // head as of the last finishBatch()
+    size_t head = 0;                                // Next position the consumer takes
+};
+
+// Sampled request log for building benchmark replay corpora. Event loops hand
+// one in every `sampleEvery` requests to a lock-free ring; a background thread
+// turns them into JSON lines, so serving never waits on the file.
+class TrafficCapture {
+public:
+    struct Record {
+        std::chrono::steady_clock::time_point arrival;
+        std::string method;
+        std::string target;
+        std::vector<std::pair<std::string, std::string>> headers;
+        size_t bodySize = 0;
+        int status = 0;
+        std::chrono::steady_clock::duration latency{};
+    };
+
+    TrafficCapture(const std::string& path, unsigned sampleEvery, std::vector<std::string> headerNames)
+        : sampleEvery(std::max(1U, sampleEvery)), headerNames(std::move(headerNames)), file(path, std::ios::app) {
+        MemoryAccount::add(MEMORY_CAPTURE, ring.footprint());
+    }
+
+    ~TrafficCapture() {
+        MemoryAccount::add(MEMORY_CAPTURE, -static_cast<int64_t>(ring.footprint()));
+        {
+            std::lock_guard<std::mutex> lock(writerMutex);
+            stopping = true;
+        }
+        stopped.notify_all();
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    // Returns false if the file cannot be opened.
+    bool start() {
+        if (!file) {
+            return false;
+        }
+        writer = std::thread([this] { write(); });
+        return true;
+    }
+
+    // Event-loop threads. True for the requests that should be recorded.
+    bool sample() {
+        static thread_local uint64_t seen = 0;
+        return ++seen % sampleEvery == 0;
+    }
+
+    // Starts a record for a sampled request; finish it with record().
+    Record begin(const Request& request) const {
+        Record record;
+        record.arrival = std::chrono::steady_clock::now();
+        record.method = request.method;
+        record.target = std::string(request.target);
+        for (const auto& name : headerNames) {
+            std::string value = findHeader(request.headers, name);
+            if (!value.empty()) {
+                record.headers.emplace_back(name, std::move(value));
+            }
+        }
+        std::string contentLength = findHeader(request.headers, "Content-Length");
+        record.bodySize = contentLength.empty() ? 0 : strtoull(contentLength.c_str(), nullptr, 10);
+        return record;
+    }
+
+    // Any thread. A record that does not fit in the ring is dropped.
+    void record(Record record, int status) {
+        record.status = status;
+        record.latency = std::chrono::steady_clock::now() - record.arrival;
+        bool wasEmpty;
+        if (ring.push(std::move(record), wasEmpty)) {
+            ++captured;
+        } else {
+            ++dropped;
+        }
+    }
+
+    std::atomic<unsigned long> captured{0};
+    std::atomic<unsigned long> dropped{0};
+
+private:
+    void write() {
+        std::unique_lock<std::mutex> lock(writerMutex);
+        while (true) {
+            bool last = stopped.wait_for(lock, std::chrono::milliseconds(CAPTURE_WRITE_INTERVAL_MS), [this] { return stopping; });
+            Record record;
+            while (ring.pop(record)) {
+                writeLine(record);
+            }
+            ring.finishBatch();
+            file.flush();
+            if (last) {
+                break;
+            }
+        }
+    }
+
+    // Inter-arrival time is measured between sampled requests
+    void writeLine(const Record& record) {
+        auto interArrival = previousArrival == std::chrono::steady_clock::time_point() || record.arrival < previousArrival
+            ? std::chrono::steady_clock::duration::zero() : record.arrival - previousArrival;
+        previousArrival = std::max(previousArrival, record.arrival);
+        file << "{\"method\":\"" << jsonEscape(record.method) << "\",\"target\":\"" << jsonEscape(record.target) << "\",\"headers\":{";
+        for (size_t i = 0; i < record.headers.size(); ++i) {
+            file << (i > 0 ? "," : "") << "\"" << jsonEscape(record.headers[i].first) << "\":\"" << jsonEscape(record.headers[i].second) << "\"";
+        }
+        file << "},\"body_bytes\":" << record.bodySize
+             << ",\"interarrival_us\":" << std::chrono::duration_cast<std::chrono::microseconds>(interArrival).count()
+             << ",\"status\":" << record.status
+             << ",\"latency_us\":" << std::chrono::duration_cast<std::chrono::microseconds>(record.latency).count() << "}\n";
+    }
+
+    const unsigned sampleEvery;
+    const std::vector<std::string> headerNames;
+    MpscQueue<Record> ring{CAPTURE_RING_CAPACITY};
+    std::ofstream file;                 // Writer thread only
+    std::chrono::steady_clock::time_point previousArrival;
+    std::thread writer;
+    std::mutex writerMutex;
+    std::condition_variable stopped;
+    bool stopping = false;
+};
+
+struct EventLoop;
+using LoopTask = std::function<void(EventLoop&)>;
+
+// Per-worker cache of the few hottest complete responses, in front of the shared
+// route table. Entries are owned by one event loop only, so serving them touches
+// no cache line another core writes. A path is admitted once its request count
+// beats the coldest entry's; counts are halved now and then so old favourites
+// fade. Entries carry the route-table generation they were built from and the
+// whole cache is dropped as soon as a newer table is published.
+class HotCache {
+public:
+    struct Entry {
+        std::string path;
+        std::shared_ptr<const std::string> response;        // keep-alive
+        std::shared_ptr<const std::string> closeResponse;   // Same response with "Connection: close"
+        uint32_t frequency = 0;
+    };
+
+    const Entry* find(std::string_view path, uint64_t generation) {
+        if (generation != entriesGeneration) {
+            entries.clear();
+            entriesGeneration = generation;
+        }
+        for (auto& entry : entries) {
+            if (entry.path == path) {
+                ++entry.frequency;
+                hits.store(hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                return &entry;
+            }
+        }
+        misses.store(misses.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // Counts a miss on a path whose response could be cached and returns true if
+    // it is now hot enough to be admitted.
+    bool wants(std::string_view path) {
+        auto counted = frequency.find(path);
+        if (counted == frequency.end()) {
+            if (frequency.size() >= HOT_CACHE_TRACKED_PATHS) {
+                decay();
+            }
+            counted = frequency.emplace(std::string(path), 0).first;
+        }
+        uint32_t count = ++counted->second;
+        if (entries.size() < HOT_CACHE_ENTRIES) {
+            return true;
+        }
+        return count > coldest()->frequency;
+    }
+
+    void insert(std::string_view path, std::shared_ptr<const std::string> response, std::shared_ptr<const std::string> closeResponse) {
+        if (entries.size() >= HOT_CACHE_ENTRIES) {
+            entries.erase(entries.begin() + (coldest() - entries.data()));
+        }
+        Entry entry;
+        entry.path = std::string(path);
+        entry.response = std::move(response);
+        entry.closeResponse = std::move(closeResponse);
+        auto counted = frequency.find(path);
+        entry.frequency = counted == frequency.end() ? 1 : counted->second;
+        entries.push_back(std::move(entry));
+    }
+
+    // Written by the owning loop only, read by /admin/stats on any loop
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+
+private:
+    Entry* coldest() {
+        return &*std::min_element(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.frequency < b.frequency;
+        });
+    }
+
+    void decay() {
+        for (auto it = frequency.begin(); it != frequency.end();) {
+            it->second /= 2;
+            it = it->second == 0 ? frequency.erase(it) : std::next(it);
+        }
+        for (auto& entry : entries) {
+            entry.frequency /= 2;
+        }
+        if (frequency.size() >= HOT_CACHE_TRACKED_PATHS) {
+            frequency.clear();
+        }
+    }
+
+    std::vector<Entry> entries;         // Small enough that a linear scan beats hashing
+    uint64_t entriesGeneration = 0;
+    std::map<std::string, uint32_t, std::less<>> frequency;   // Requests per path since the last decay
+};
+
+// In-process CPU sampling profiler. ITIMER_PROF delivers SIGPROF as the process
+// burns CPU; the handler walks the interrupted thread's frame-pointer chain into
+// a preallocated buffer, and the stacks are aggregated and symbolized once
+// sampling ends. Stacks are only complete for code built with
+// -fno-omit-frame-pointer, and names need -rdynamic; otherwise frames show as
+// module+offset.
+class Profiler {
+public:
+    // Lets the profiler walk the calling thread's stack beyond the frame it was
+    // interrupted in. Call once at the start of every long-lived thread.
+    static void registerThread() {
+        pthread_attr_t attributes;
+        if (pthread_getattr_np(pthread_self(), &attributes) != 0) {
+            return;
+        }
+        void* base;
+        size_t size;
+        if (pthread_attr_getstack(&attributes, &base, &size) == 0) {
+            stackBottom() = reinterpret_cast<uintptr_t>(base);
+            stackTop() = reinterpret_cast<uintptr_t>(base) + size;
+        }
+        pthread_attr_destroy(&attributes);
+    }
+
+    // Samples every thread at `hz` for `duration`, or until `cancel` is set, and
+    // returns the stacks folded ("outer;inner count" per line). Blocks the
+    // caller. Returns false, with the reason in `folded`, if another profile is
+    // already running or the timer cannot be started.
+    static bool profile(std::chrono::milliseconds duration, int hz, const std::atomic<bool>& cancel, std::string& folded) {
+        State& profiler = state();
+        bool idle = false;
+        if (!profiler.running.compare_exchange_strong(idle, true)) {
+            folded = "A profile is already running\n";
+            return false;
+        }
+        profiler.samples.reset(new Sample[PROFILE_MAX_SAMPLES]);
+        profiler.taken = 0;
+
+        // The handler stays installed afterwards: a late SIGPROF with the default
+        // action would kill the process
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            struct sigaction action = {};
+            action.sa_sigaction = onSignal;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGPROF, &action, nullptr);
+        });
+        profiler.active = true;
+        long period = 1000000 / std::clamp(hz, 1, 1000);
+        struct itimerval timer = {};
+        timer.it_interval.tv_sec = period / 1000000;
+        timer.it_interval.tv_usec = period % 1000000;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_PROF, &timer, nullptr) == -1) {
+            folded = std::string("Starting the profiling timer failed: ") + strerror(errno) + "\n";
+            log("ERROR", "Profiler", "profile", "Starting the profiling timer", strerror(errno));
+            finish(profiler);
+            return false;
+        }
+        log("INFO", "Profiler", "profile", "Sampling", std::to_string(duration.count()) + " ms at " + std::to_string(hz) + " Hz");
+
+        auto deadline = std::chrono::steady_clock::now() + duration;
+        while (!cancel && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min<long long>(100, duration.count())));
+        }
+
+        timer = {};
+        if (setitimer(ITIMER_PROF, &timer, nullptr) == -1) {
+            log("ERROR", "Profiler", "profile", "Stopping the profiling timer", strerror(errno));
+        }
+        size_t taken = std::min<size_t>(profiler.taken, PROFILE_MAX_SAMPLES);
+        finish(profiler, &folded);
+        log("INFO", "Profiler", "profile", "Samples taken", std::to_string(taken));
+        return true;
+    }
+
+    // Follows the frame-pointer chain from `fp` on the calling thread, storing
+    // return addresses into `frames` from index `depth` on. Returns the new depth.
+    // Only frames inside the thread's stack are followed, so a register that is
+    // not a frame pointer at all ends the walk instead of faulting, and one that
+    // happens to point into the stack ends it at an implausible return address.
+    // Safe in a signal handler.
+    static int walkStack(uintptr_t fp, uintptr_t sp, uintptr_t* frames, int depth, int maxDepth) {
+        uintptr_t bottom = std::max(sp, stackBottom());
+        uintptr_t top = stackTop();
+        while (depth < maxDepth && fp >= bottom && fp % sizeof(uintptr_t) == 0 && fp + 2 * sizeof(uintptr_t) <= top) {
+            const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+            if (frame[1] < PROFILE_MIN_CODE_ADDRESS || (frame[1] >= bottom && frame[1] < top)) {
+                break;
+            }
+            // Back into the call instruction, so the caller's line is the one named
+            frames[depth++] = frame[1] - 1;
+            if (frame[0] <= fp) {
+                break;
+            }
+            bottom = fp;
+            fp = frame[0];
+        }
+        return depth;
+    }
+
+    // Function name for a code address, or module+offset when it has no symbol.
+    static std::string symbolize(uintptr_t address) {
+        Dl_info info;
+        if (dladdr(reinterpret_cast<void*>(address), &info) == 0) {
+            char hex[32];
+            snprintf(hex, sizeof(hex), "0x%lx", static_cast<unsigned long>(address));
+            return hex;
+        }
+        if (info.dli_sname) {
+            int status;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::string name = status == 0 ? demangled : info.dli_sname;
+            free(demangled);
+            return name;
+        }
+        const char* module = info.dli_fname ? strrchr(info.dli_fname, '/') : nullptr;
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%lx", static_cast<unsigned long>(address - reinterpret_cast<uintptr_t>(info.dli_fbase)));
+        return std::string(module ? module + 1 : info.dli_fname ? info.dli_fname : "?") + offset;
+    }
+
+private:
+    struct Sample {
+        int depth;
+        uintptr_t frames[PROFILE_MAX_DEPTH];    // Innermost first
+    };
+
+    struct State {
+        std::atomic<bool> running{false};       // A profile() call owns the state
+        std::atomic<bool> active{false};        // Signals should be recorded
+        std::atomic<size_t> taken{0};
+        std::atomic<int> writers{0};            // Handlers between claiming a sample and finishing it
+        std::unique_ptr<Sample[]> samples;
+    };
+
+    // Stops recording, folds what was recorded into `folded` if given, and frees
+    // the buffer once no handler can still write to it.
+    static void finish(State& profiler, std::string* folded = nullptr) {
+        profiler.active = false;
+        while (profiler.writers.load() > 0) {
+            std::this_thread::yield();
+        }
+        if (folded) {
+            *folded = fold(profiler.samples.get(), std::min<size_t>(profiler.taken, PROFILE_MAX_SAMPLES));
+        }
+        profiler.samples.reset();
+        profiler.running = false;
+    }
+
+    static State& state() {
+        static State profiler;
+        return profiler;
+    }
+
+    static uintptr_t& stackTop() {
+        static thread_local uintptr_t top = 0;
+        return top;
+    }
+
+    static uintptr_t& stackBottom() {
+        static thread_local uintptr_t bottom = 0;
+        return bottom;
+    }
+
+    // Signal context: no allocation, no locks.
+    static void onSignal(int, siginfo_t*, void* context) {
+        State& profiler = state();
+        // Counted before checking `active`, so finish() either sees this handler
+        // or this handler sees the profile stopped
+        ++profiler.writers;
+        size_t index = profiler.active ? profiler.taken.fetch_add(1, std::memory_order_relaxed) : PROFILE_MAX_SAMPLES;
+        if (index >= PROFILE_MAX_SAMPLES) {
+            --profiler.writers;
+            return;
+        }
+        int savedErrno = errno;
+        Sample& sample = profiler.samples[index];
+        const mcontext_t& machine = static_cast<ucontext_t*>(context)->uc_mcontext;
+#if defined(__x86_64__)
+        uintptr_t pc = machine.gregs[REG_RIP];
+        uintptr_t fp = machine.gregs[REG_RBP];
+        uintptr_t sp = machine.gregs[REG_RSP];
+#elif defined(__aarch64__)
+        uintptr_t pc = machine.pc;
+        uintptr_t fp = machine.regs[29];
+        uintptr_t sp = machine.sp;
+#else
+        uintptr_t pc = 0, fp = 0, sp = 0;
+#endif
+        sample.frames[0] = pc;
+        sample.depth = walkStack(fp, sp, sample.frames, 1, PROFILE_MAX_DEPTH);
+        errno = savedErrno;
+        --profiler.writers;
+    }
+
+    static std::string fold(const Sample* samples, size_t count) {
+        std::unordered_map<uintptr_t, std::string> names;
+        auto name = [&names](uintptr_t address) -> const std::string& {
+            auto found = names.find(address);
+            if (found == names.end()) {
+                found = names.emplace(address, symbolize(address)).first;
+            }
+            return found->second;
+        };
+        std::map<std::vector<uintptr_t>, size_t> stacks;
+        for (size_t i = 0; i < count; ++i) {
+            // A walk that strayed through code without frame pointers ends at an
+            // address outside any loaded module; the stack is cut there
+            int depth = 1;
+            while (depth < samples[i].depth && name(samples[i].frames[depth]).compare(0, 2, "0x") != 0) {
+                ++depth;
+            }
+            ++stacks[std::vector<uintptr_t>(samples[i].frames, samples[i].frames + depth)];
+        }
+        std::string folded;
+        for (const auto& [stack, samplesOfStack] : stacks) {
+            for (auto frame = stack.rbegin(); frame != stack.rend(); ++frame) {
+                if (frame != stack.rbegin()) {
+                    folded += ';';
+                }
+                folded += name(*frame);
+            }
+            folded += ' ' + std::to_string(samplesOfStack) + '\n';
+        }
+        return folded;
+    }
+};
+
+// Sampling allocation profiler. With CHIPPORT_HEAP_PROFILER defined in exactly
+// one translation unit before including this header, operator new reports to
+// it; while a profile runs, allocations are sampled about once every
+// `sampleBytes` bytes (Poisson, so large and small allocations are weighted
+// fairly) and their stacks kept. Stacks are unwound from the tables the
+// compiler emits for exceptions, so callers are found through libraries built
+// without frame pointers too. report() scales the samples back
+// up to estimated bytes and allocation counts per call site.
+class HeapProfiler {
+public:
+    // True if operator new was replaced, i.e. profiles will see allocations.
+    static bool available() {
+        return state().hooked;
+    }
+
+    // Starts sampling. Returns false if a profile is already running.
+    static bool start(size_t sampleBytes) {
+        State& profiler = state();
+        bool idle = false;
+        if (!profiler.running.compare_exchange_strong(idle, true)) {
+            return false;
+        }
+        profiler.samples.reset(new Sample[HEAP_PROFILE_MAX_SAMPLES]);
+        profiler.taken = 0;
+        profiler.sampleBytes = std::max<size_t>(1, sampleBytes);
+        ++profiler.epoch;
+        // The first backtrace() loads the unwinder, which must not happen inside operator new
+        void* frame;
+        backtrace(&frame, 1);
+        active().store(true);
+        return true;
+    }
+
+    // Stops sampling and returns the report, per `requests` requests if non-zero.
+    // `folded` gives stacks weighted by bytes for flame graphs instead of the
+    // table of call sites.
+    static std::string stop(size_t requests, bool folded) {
+        State& profiler = state();
+        active().store(false);
+        // Allocations that saw the profile active may still be writing their sample
+        while (profiler.writers.load() > 0) {
+            std::this_thread::yield();
+        }
+        std::string report = HeapProfiler::report(std::min<size_t>(profiler.taken, HEAP_PROFILE_MAX_SAMPLES), requests, folded);
+        profiler.samples.reset();
+        profiler.running = false;
+        return report;
+    }
+
+    // Called once by the translation unit that replaces operator new.
+    static void markHooked() {
+        state().hooked = true;
+    }
+
+    // Called by the replaced operator new for every allocation, with the return
+    // address of the operator new call.
+    static void onAllocation(size_t size, void* caller) {
+        if (!active().load(std::memory_order_relaxed)) {
+            return;
+        }
+        static thread_local bool inside = false;
+        static thread_local int64_t untilSample = 0;
+        static thread_local uint64_t seenEpoch = 0;
+        static thread_local uint64_t random = 0;
+        State& profiler = state();
+        if (inside) {
+            return;
+        }
+        inside = true;
+        if (seenEpoch != profiler.epoch) {
+            seenEpoch = profiler.epoch;
+            random = reinterpret_cast<uintptr_t>(&random) ^ static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+            untilSample = nextInterval(random, profiler.sampleBytes.load());
+        }
+        untilSample -= static_cast<int64_t>(size);
+        if (untilSample <= 0) {
+            untilSample = nextInterval(random, profiler.sampleBytes.load());
+            // Counted before checking `active` again, so stop() either sees this
+            // writer or this writer sees the profile stopped
+            ++profiler.writers;
+            size_t index = active().load() ? profiler.taken.fetch_add(1, std::memory_order_relaxed) : HEAP_PROFILE_MAX_SAMPLES;
+            if (index < HEAP_PROFILE_MAX_SAMPLES) {
+                // The profiler's own frames are dropped when the report is built
+                Sample& sample = profiler.samples[index];
+                sample.size = size;
+                // Frames inside the profiler and operator new end at `caller`; they
+                // are dropped here since unnamed ones cannot be recognized later
+                void* frames[HEAP_PROFILE_MAX_DEPTH + 4];
+                int depth = backtrace(frames, HEAP_PROFILE_MAX_DEPTH + 4);
+                int first = 0;
+                while (first < depth && frames[first] != caller) {
+                    ++first;
+                }
+                first = first == depth ? 0 : first;
+                sample.depth = std::min(depth - first, HEAP_PROFILE_MAX_DEPTH);
+                for (int i = 0; i < sample.depth; ++i) {
+                    // Back into the call instruction, so the caller's line is the one named
+                    sample.frames[i] = reinterpret_cast<uintptr_t>(frames[first + i]) - 1;
+                }
+            }
+            --profiler.writers;
+        }
+        inside = false;
+    }
+
+private:
+    struct Sample {
+        size_t size;
+        int depth;
+        uintptr_t frames[HEAP_PROFILE_MAX_DEPTH];   // Innermost first
+    };
+
+    struct State {
+        bool hooked = false;
+        std::atomic<bool> running{false};
+        std::atomic<size_t> taken{0};
+        std::atomic<int> writers{0};                // Allocations between claiming a sample and finishing it
+        std::atomic<uint64_t> epoch{0};             // Bumped per profile so threads redraw their interval
+        std::atomic<size_t> sampleBytes{HEAP_PROFILE_SAMPLE_BYTES};   // Read by allocating threads while the profile runs
+        std::unique_ptr<Sample[]> samples;
+    };
+
+    // Checked on every allocation, so it is a plain flag rather than part of State
+    static std::atomic<bool>& active() {
+        static std::atomic<bool> sampling{false};
+        return sampling;
+    }
+
+    // Exponentially distributed with mean `mean`, from a per-thread xorshift.
+    static int64_t nextInterval(uint64_t& random, size_t mean) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        double uniform = (static_cast<double>(random >> 11) + 1) / 9007199254740993.0;
+        return static_cast<int64_t>(-std::log(uniform) * mean) + 1;
+    }
+
+    static std::string report(size_t taken, size_t requests, bool folded) {
+        struct Site {
+            double bytes = 0;
+            double allocations = 0;
+        };
+        State& profiler = state();
+        double mean = static_cast<double>(profiler.sampleBytes.load());
+        std::unordered_map<uintptr_t, std::string> names;
+        auto name = [&names](uintptr_t address) -> const std::string& {
+            auto found = names.find(address);
+            if (found == names.end()) {
+                found = names.emplace(address, Profiler::symbolize(address)).first;
+            }
+            return found->second;
+        };
+        auto internal = [&name](uintptr_t address) {
+            const std::string& frame = name(address);
+            return frame.compare(0, 24, "chipport::HeapProfiler::") == 0 || frame.compare(0, 26, "chipport::profiledAllocate") == 0 ||
+                   frame.compare(0, 12, "operator new") == 0;
+        };
+
+        std::map<std::vector<uintptr_t>, Site> sites;
+        double totalBytes = 0;
+        double totalAllocations = 0;
+        for (size_t i = 0; i < taken; ++i) {
+            const Sample& sample = profiler.samples[i];
+            // An allocation of `size` bytes is sampled with probability 1 - e^(-size/mean)
+            double size = static_cast<double>(std::max<size_t>(sample.size, 1));
+            double weight = 1 / (1 - std::exp(-size / mean));
+            int first = 0;
+            while (first + 1 < sample.depth && internal(sample.frames[first])) {
+                ++first;
+            }
+            // Code built without frame pointers leaves junk behind it; an address
+            // outside any loaded module ends the stack
+            int last = first + 1;
+            while (last < sample.depth && name(sample.frames[last]).compare(0, 2, "0x") != 0) {
+                ++last;
+            }
+            Site& site = sites[std::vector<uintptr_t>(sample.frames + first, sample.frames + last)];
+            site.bytes += size * weight;
+            site.allocations += weight;
+            totalBytes += size * weight;
+            totalAllocations += weight;
+        }
+        double scale = requests > 0 ? 1.0 / requests : 1.0;
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        if (folded) {
+            // Addresses in the same function fold into one frame
+            std::map<std::string, double> stacks;
+            for (const auto& [stack, site] : sites) {
+                std::string line;
+                for (auto frame = stack.rbegin(); frame != stack.rend(); ++frame) {
+                    line += (frame != stack.rbegin() ? ";" : "") + name(*frame);
+                }
+                stacks[line] += site.bytes * scale;
+            }
+            for (const auto& [line, bytes] : stacks) {
+                out << line << ' ' << static_cast<uint64_t>(bytes + 0.5) << '\n';
+            }
+            return out.str();
+        }
+
+        std::vector<std::pair<const std::vector<uintptr_t>*, Site>> ranked;
+        for (const auto& [stack, site] : sites) {
+            ranked.emplace_back(&stack, site);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) { return a.second.bytes > b.second.bytes; });
+        const char* unit = requests > 0 ? "/request" : "";
+        out << "samples " << taken << " sample_bytes " << profiler.sampleBytes.load() << "\n"
+            << "bytes" << unit << " " << totalBytes * scale << " allocations" << unit << " " << totalAllocations * scale << "\n";
+        for (size_t i = 0; i < ranked.size() && i < HEAP_PROFILE_REPORT_SITES; ++i) {
+            const auto& stack = *ranked[i].first;
+            out << "\n" << ranked[i].second.bytes * scale << " bytes" << unit << ", " << ranked[i].second.allocations * scale << " allocations" << unit << "\n";
+            for (size_t frame = 0; frame < stack.size() && frame < HEAP_PROFILE_REPORT_FRAMES; ++frame) {
+                out << "    " << name(stack[frame]) << "\n";
+            }
+        }
+        return out.str();
+    }
+
+    static State& state() {
+        static State profiler;
+        return profiler;
+    }
+
+};
+
+// Worker threads for handlers too slow to run on an event loop. The queue in
+// front of them is managed with CoDel: once every task has waited longer than
+// CODEL_TARGET_MS for a whole CODEL_INTERVAL_MS, the oldest ones are failed fast
+// at an increasing rate until waits are short again. Under overload a few
+// requests get a quick 503 and the rest fresh service, instead of all of them
+// waiting behind a stale backlog.
+class HandlerPool {
+public:
+    // Called with expired=true, instead of doing the work, for a task that was dropped
+    using Task = std::function<void(bool expired)>;
+
+    // Starts `threads` workers plus PRIORITY_HANDLER_THREADS that only run
+    // priority tasks; the others run priority tasks before regular ones too.
+    // Workers read the route table, so they register with `readers`. Their slots
+    // are claimed up front: if there are not enough, no worker is started and
+    // started() is false.
+    HandlerPool(size_t threads, Qsbr& readers) : readers(readers) {
+        std::vector<int> slots;
+        for (size_t i = 0; i < threads + PRIORITY_HANDLER_THREADS; ++i) {
+            int slot = readers.registerReader();
+            if (slot == -1) {
+                log("ERROR", "HandlerPool", "HandlerPool", "Not enough route-table reader slots", "Threads: " + std::to_string(threads));
+                for (int taken : slots) {
+                    readers.unregisterReader(taken);
+                }
+                return;
+            }
+            readers.offline(slot);
+            slots.push_back(slot);
+        }
+        for (size_t i = 0; i < slots.size(); ++i) {
+            bool reserved = i < PRIORITY_HANDLER_THREADS;
+            workers.emplace_back([this, slot = slots[i], reserved] { work(slot, reserved); });
+        }
+    }
+
+    bool started() const {
+        return !workers.empty();
+    }
+
+    ~HandlerPool() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        available.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Returns false if the queue is at its hard limit; the caller fails the task
+    // itself. Priority tasks have a queue of their own, which CoDel never drops from.
+    bool submit(Task task, bool priority = false) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (priority) {
+                if (priorityQueue.size() >= OFFLOAD_QUEUE_LIMIT) {
+                    ++rejected;
+                    return false;
+                }
+                priorityQueue.push_back(std::move(task));
+            } else {
+                if (queue.size() >= OFFLOAD_QUEUE_LIMIT) {
+                    ++rejected;
+                    return false;
+                }
+                queue.push_back({std::chrono::steady_clock::now(), std::move(task)});
+                queued = queue.size();
+            }
+        }
+        // The woken worker may be a reserved one that cannot take a regular task
+        available.notify_all();
+        return true;
+    }
+
+    std::atomic<size_t> queued{0};
+    std::atomic<unsigned long> dropped{0};      // Failed fast by CoDel
+    std::atomic<unsigned long> rejected{0};     // Refused at the hard limit
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Queued {
+        Clock::time_point enqueued;
+        Task task;
+    };
+
+    void work(int slot, bool reserved) {
+        Profiler::registerThread();
+        while (true) {
+            std::vector<Task> expired;
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                available.wait(lock, [this, reserved] { return stopping || !priorityQueue.empty() || (!reserved && !queue.empty()); });
+                if (stopping) {
+                    for (auto& waiting : queue) {
+                        expired.push_back(std::move(waiting.task));
+                    }
+                    queue.clear();
+                    for (auto& waiting : priorityQueue) {
+                        expired.push_back(std::move(waiting));
+                    }
+                    priorityQueue.clear();
+                } else if (!priorityQueue.empty()) {
+                    task = std::move(priorityQueue.front());
+                    priorityQueue.pop_front();
+                } else {
+                    task = dequeue(expired);
+                }
+                queued = queue.size();
+            }
+            for (auto& failed : expired) {
+                failed(true);
+            }
+            if (task) {
+                readers.online(slot);
+                task(false);
+                readers.offline(slot);
+            } else if (stopping) {
+                break;
+            }
+        }
+        readers.unregisterReader(slot);
+    }
+
+    // CoDel dequeue (RFC 8289) with sojourn time measured per task. Tasks dropped
+    // on the way are moved to `expired`, to be failed outside the lock.
+    Task dequeue(std::vector<Task>& expired) {
+        Clock::time_point now = Clock::now();
+        bool okToDrop = false;
+        Task task = pop(now, okToDrop);
+
+        if (dropping) {
+            if (!okToDrop) {
+                dropping = false;
+            }
+            while (dropping && now >= dropNext && task) {
+                expired.push_back(std::move(task));
+                ++dropped;
+                ++dropCount;
+                task = pop(now, okToDrop);
+                if (!okToDrop) {
+                    dropping = false;
+                } else {
+                    dropNext = controlLaw(dropNext);
+                }
+            }
+        } else if (okToDrop && task) {
+            expired.push_back(std::move(task));
+            ++dropped;
+            task = pop(now, okToDrop);
+            dropping = true;
+            // Resume near the previous drop rate if the last dropping state ended recently
+            dropCount = dropCount > 2 && now - dropNext < 16 * interval() ? dropCount - 2 : 1;
+            dropNext = controlLaw(now);
+        }
+        return task;
+    }
+
+    // Takes the oldest task and decides whether waits have been above target
+    // for long enough to drop it.
+    Task pop(Clock::time_point now, bool& okToDrop) {
+        okToDrop = false;
+        if (queue.empty()) {
+            firstAboveTime = Clock::time_point();
+            return nullptr;
+        }
+        Queued front = std::move(queue.front());
+        queue.pop_front();
+        if (now - front.enqueued < std::chrono::milliseconds(CODEL_TARGET_MS) || queue.empty()) {
+            firstAboveTime = Clock::time_point();
+        } else if (firstAboveTime == Clock::time_point()) {
+            firstAboveTime = now + interval();
+        } else if (now >= firstAboveTime) {
+            okToDrop = true;
+        }
+        return std::move(front.task);
+    }
+
+    Clock::time_point controlLaw(Clock::time_point from) const {
+        return from + std::chrono::duration_cast<Clock::duration>(interval() / std::sqrt(static_cast<double>(dropCount)));
+    }
+
+    static std::chrono::milliseconds interval() {
+        return std::chrono::milliseconds(CODEL_INTERVAL_MS);
+    }
+
+    Qsbr& readers;
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable available;
+    std::deque<Queued> queue;
+    std::deque<Task> priorityQueue;
+    bool stopping = false;
+    // CoDel state, guarded by queueMutex
+    bool dropping = false;
+    Clock::time_point firstAboveTime;
+    Clock::time_point dropNext;
+    unsigned dropCount = 0;
+};
+
+// Per-thread state of one event loop. Every thread inside HttpServer::run() owns
+// one, and nothing but post() and wake() is called on it from other threads.
+struct EventLoop {
+    int epollFd = -1;
+    int wakeFd = -1;                    // eventfd that interrupts epoll_wait for posted tasks and stop()
+    bool primary = false;               // Also checks assets for reloads
+    bool draining = false;              // Listeners already removed from this loop
+    int readerSlot = -1;                // Route-table reader registration, see Qsbr
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    std::vector<int> pendingFlush;
+    std::vector<int> pendingPriorityFlush;
+    std::vector<int> readyList;         // Connections to resume next iteration; epoll will not report them again
+    uint64_t iteration = 0;
+    HotCache hotCache;
+    MpscQueue<LoopTask> mailbox{MAILBOX_CAPACITY};      // Work other threads hand to this loop
+    std::atomic<int> offloaded{0};                      // Handler-pool tasks that will still post here
+    std::chrono::steady_clock::time_point nextAssetCheck = std::chrono::steady_clock::now();
+    std::deque<std::pair<std::chrono::steady_clock::time_point, uint64_t>> lingering;   // Deadline and connection id, in deadline order
+    std::unordered_map<uint64_t, int> lingeringFds;    // Connection id to fd for the entries above
+    std::chrono::steady_clock::time_point nextDeadlineCheck = std::chrono::steady_clock::now();
+
+    EventLoop() {
+        MemoryAccount::add(MEMORY_MAILBOXES, mailbox.footprint());
+    }
+
+    ~EventLoop() {
+        MemoryAccount::add(MEMORY_MAILBOXES, -static_cast<int64_t>(mailbox.footprint()));
+        connections.clear();
+        if (epollFd != -1) {
+            close(epollFd);
+        }
+        if (wakeFd != -1) {
+            close(wakeFd);
+        }
+    }
+
+    // Hands `task` to this loop's thread, from any thread. The eventfd is only
+    // written when the loop had nothing left to run. Returns false if the mailbox is full.
+    bool post(LoopTask task) {
+        bool wasEmpty = false;
+        if (!mailbox.push(std::move(task), wasEmpty)) {
+            return false;
+        }
+        if (wasEmpty) {
+            wake();
+        }
+        return true;
+    }
+
+    void wake() {
+        if (wakeFd == -1) {
+            return;
+        }
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            log("ERROR", "EventLoop", "wake", "Writing eventfd", strerror(errno));
+        }
+    }
+};
+
+// Embeddable HTTP server. Configure it (listeners, routes through
+// getRequestHandler(), fast paths), call start(), then run() on every thread
+// that should serve. stop() and drain() may be called from any thread.
+class HttpServer {
+public:
+    HttpServer(int port, int backlog = 10, bool proxyProtocol = false)
+        : HttpServer(std::vector<ListenAddress>{{"0.0.0.0:" + std::to_string(port), proxyProtocol}}, backlog) {}
+
+    HttpServer(const std::vector<ListenAddress>& addresses, int backlog = 10, size_t maxConnections = 0)
+        : backlog(backlog), maxConnections(maxConnections) {
+        for (const auto& address : addresses) {
+            listeners.emplace_back();
+            listeners.back().address = address;
+        }
+    }
+
+    // Every run() must have returned by now.
+    ~HttpServer() {
+        loopback.connections.clear();
+        for (const auto& listener : listeners) {
+            if (listener.fd != -1) {
+                close(listener.fd);
+            }
+            log("INFO", "HttpServer", "Destructor", "Server shutdown", "Listener: " + listener.address.spec + ", Accepted: " + std::to_string(listener.accepted));
+        }
+    }
+
+    // Whether TCP connections sending large responses get TCP_NOTSENT_LOWAT and a
+    // bounded send buffer (the default) or keep the kernel's autotuning.
+    // Must be called before start().
+    void setSocketTuning(bool enabled) {
+        socketTuning = enabled;
+    }
+
+    // Appends one in every `sampleEvery` requests to `path` as JSON lines, with
+    // the values of `headerNames` if present. Must be called before start().
+    void setCapture(const std::string& path, unsigned sampleEvery,
+                    std::vector<std::string> headerNames = {"Host", "User-Agent", "Accept", "Accept-Encoding", "Content-Type"}) {
+        capture = std::make_unique<TrafficCapture>(path, sampleEvery, std::move(headerNames));
+        capturePath = path;
+    }
+
+    // Threads for offloaded handlers, besides the PRIORITY_HANDLER_THREADS kept for
+    // admin listeners. Without any (the default) they run on the event loop like
+    // every other handler. Must be called before start().
+    void setHandlerThreads(size_t threads) {
+        handlerThreads = threads;
+    }
+
+    // Opens the listeners and publishes the routes. Returns false if any listener
+    // cannot be opened.
+    bool start() {
+        // Peers resetting mid-sendfile must surface as EPIPE, not kill the process
+        signal(SIGPIPE, SIG_IGN);
+
+        auto began = std::chrono::steady_clock::now();
+        requestHandler.publishRoutes();
+        auto published = std::chrono::steady_clock::now();
+        if (capture && !capture->start()) {
+            log("ERROR", "HttpServer", "start", "Opening capture file", "failed: " + capturePath);
+            return false;
+        }
+        if (handlerThreads > 0) {
+            handlerPool = std::make_unique<HandlerPool>(handlerThreads, requestHandler.readers());
+            if (!handlerPool->started()) {
+                handlerPool.reset();
+                return false;
+            }
+        }
+        for (auto& listener : listeners) {
+            if (!openListener(listener)) {
+                return false;
+            }
+        }
+
+        auto ms = [](auto duration) { return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count()); };
+        auto listening = std::chrono::steady_clock::now();
+        log("INFO", "HttpServer", "start", "Server initialization", "successful in " + ms(listening - began) + " ms (routes "
+            + ms(published - began) + " ms, listeners " + ms(listening - published) + " ms)");
+        return true;
+    }
+
+    // Makes every run() return promptly, closing the connections it serves.
+    void stop() {
+        stopping = true;
+        wakeLoops();
+    }
+
+    // Stops accepting connections and makes every run() return once the
+    // connections it serves are done: idle ones are closed at once, busy ones
+    // after the response they are waiting for, sent with "Connection: close".
+    void drain() {
+        draining = true;
+        broadcast([this](EventLoop& loop) {
+            beginDrain(loop);
+        });
+    }
+
+    // Runs `task` once on every event loop currently inside run(), on that loop's thread.
+    void broadcast(const LoopTask& task) {
+        std::lock_guard<std::mutex> lock(loopsMutex);
+        for (EventLoop* loop : loops) {
+            if (!loop->post(task)) {
+                log("ERROR", "HttpServer", "broadcast", "Mailbox full", "Task dropped");
+            }
+        }
+    }
+
+    // Registers a fixed endpoint whose response never changes. Its bytes are
+    // serialized once here; matching requests cost a memcmp and a send.
+    void addFastPath(const std::string& method, const std::string& path, const std::string& contentType, const std::string& body) {
+        for (const char* version : {"HTTP/1.1", "HTTP/1.0"}) {
+            Response response = {STATUS_SUCCESS, body, contentType};
+            FastPath fastPath;
+            fastPath.requestLine = method + " " + path + " " + version + "\r\n";
+            fastPath.response = response.buildHeader(strcmp(version, "HTTP/1.1") == 0) + body;
+            fastPath.closeResponse = response.buildHeader(false) + body;
+            fastPaths.push_back(std::move(fastPath));
+        }
+    }
+
+    RequestHandler& getRequestHandler() {
+        return requestHandler;
+    }
+
+    const std::deque<Listener>& getListeners() const {
+        return listeners;
+    }
+
+    // Adds a connection on an in-memory transport. It is not watched by epoll;
+    // deliver() stands in for the event-loop iteration that would serve it.
+    int openLoopback(LoopbackTransport& transport, const std::string& peerAddress = "loopback") {
+        int id = transport.open();
+        auto connection = std::make_unique<Connection>(id, &transport, peerAddress);
+        connection->loop = &loopback;
+        connection->id = ++lastConnectionId;
+        loopback.connections[id] = std::move(connection);
+        ++openConnections;
+        ++regularConnections;
+        return id;
+    }
+
+    // Parses and answers everything pushed to a loopback connection, then flushes
+    // the responses into its output. Returns false once the server closed it.
+    bool deliver(int id) {
+        auto it = loopback.connections.find(id);
+        if (it == loopback.connections.end()) {
+            return false;
+        }
+        if (loopback.readerSlot == -1) {
+            loopback.readerSlot = requestHandler.readers().registerReader();
+        } else {
+            requestHandler.readers().online(loopback.readerSlot);
+        }
+        if (loopback.readerSlot == -1) {
+            return false;
+        }
+        ++loopback.iteration;
+        onReadable(*it->second);
+        drainMailbox(loopback);
+        flushPending(loopback);
+        // Everything pushed is answered before returning, however many iterations that takes
+        while (!loopback.readyList.empty()) {
+            ++loopback.iteration;
+            resumeReady(loopback);
+            drainMailbox(loopback);
+            flushPending(loopback);
+        }
+        requestHandler.readers().offline(loopback.readerSlot);
+        return loopback.connections.count(id) != 0;
+    }
+
+    // Runs an event loop on the calling thread until stop(), or drain() has
+    // finished. Call it from as many threads as should serve: the listeners are
+    // shared and the kernel wakes one loop per incoming connection. The first
+    // loop also serves the HTTP/3 listeners and reloads changed assets.
+    void run() {
+        Profiler::registerThread();
+        EventLoop loop;
+        if (!openLoop(loop)) {
+            closeLoop(loop);
+            return;
+        }
+        if (draining) {
+            // drain() was called before this loop could receive its broadcast
+            beginDrain(loop);
+        }
+        log("INFO", "HttpServer", "run", "Server start", "Waiting for connections...");
+        struct epoll_event events[MAX_EVENTS];
+
+        while (!stopping) {
+            if (loop.draining && loop.connections.empty()) {
+                break;
+            }
+
+            // Blocked in epoll_wait the loop holds no route-table pointers, so it
+            // must not hold up reclamation
+            requestHandler.readers().offline(loop.readerSlot);
+            int count = epoll_wait(loop.epollFd, events, MAX_EVENTS, nextTimeout(loop));
+            requestHandler.readers().online(loop.readerSlot);
+            if (count == -1) {
+                if (errno != EINTR) {
+                    log("ERROR", "HttpServer", "run", "Waiting for events", strerror(errno));
+                }
+                continue;
+            }
+            ++loop.iteration;
+
+            // Admin listeners and their connections first, so operational endpoints
+            // stay responsive however busy the rest of the iteration is
+            for (int pass = 0; pass < 2; ++pass) {
+                for (int i = 0; i < count; ++i) {
+                    bool priority = (events[i].data.u64 & PRIORITY_EVENT_FLAG) != 0;
+                    if (priority == (pass == 0)) {
+                        handleEvent(loop, events[i]);
+                    }
+                }
+            }
+            resumeReady(loop);
+
+            drainMailbox(loop);
+            expireDeadlines(loop);
+            flushPending(loop);
+            expireLingering(loop);
+
+            if (loop.primary && std::chrono::steady_clock::now() >= loop.nextAssetCheck) {
+                requestHandler.readers().reclaim();
+                requestHandler.reloadChangedAssets();
+                loop.nextAssetCheck = std::chrono::steady_clock::now() + std::chrono::milliseconds(ASSET_CHECK_INTERVAL_MS);
+            }
+        }
+        closeLoop(loop);
+        log("INFO", "HttpServer", "run", "Server stop", "Event loop finished");
+    }
+
+private:
+    void handleEvent(EventLoop& loop, const struct epoll_event& event) {
+        int fd = static_cast<int>(event.data.u64 & 0xFFFFFFFF);
+        if (fd == loop.wakeFd) {
+            uint64_t count;
+            while (read(loop.wakeFd, &count, sizeof(count)) > 0) {
+            }
+            return;
+        }
+        if (Listener* listener = findListener(fd)) {
+            acceptConnections(loop, *listener);
+            return;
+        }
+
+        auto it = loop.connections.find(fd);
+        if (it == loop.connections.end()) {
+            return;
+        }
+        Connection& connection = *it->second;
+
+        if (event.events & EPOLLERR) {
+            closeConnection(connection);
+            return;
+        }
+        if (event.events & EPOLLOUT) {
+            scheduleFlush(connection);
+        }
+        if (event.events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+            onReadable(connection);
+        }
+    }
+
+    static uint64_t eventKey(int fd, bool priority) {
+        return static_cast<uint32_t>(fd) | (priority ? PRIORITY_EVENT_FLAG : 0);
+    }
+
+    // Creates the loop's epoll instance and registers the wakeup eventfd and every
+    // listener with it. Listeners are shared between loops with EPOLLEXCLUSIVE so
+    // a connection wakes only one of them.
+    bool openLoop(EventLoop& loop) {
+        {
+            std::lock_guard<std::mutex> lock(loopsMutex);
+            loop.primary = !primaryTaken;
+            primaryTaken = true;
+            loops.push_back(&loop);
+        }
+
+        loop.readerSlot = requestHandler.readers().registerReader();
+        if (loop.readerSlot == -1) {
+            return false;
+        }
+        loop.epollFd = epoll_create1(EPOLL_CLOEXEC);
+        loop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop.epollFd == -1 || loop.wakeFd == -1) {
+            log("ERROR", "HttpServer", "run", "Epoll creation", "failed");
+            return false;
+        }
+
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = eventKey(loop.wakeFd, true);
+        if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, loop.wakeFd, &event) == -1) {
+            log("ERROR", "HttpServer", "run", "Registering wakeup eventfd", "failed");
+            return false;
+        }
+        for (const auto& listener : listeners) {
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            event.data.u64 = eventKey(listener.fd, listener.address.admin);
+            if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, listener.fd, &event) == -1) {
+                log("ERROR", "HttpServer", "run", "Registering listener", "failed: " + listener.address.spec);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void closeLoop(EventLoop& loop) {
+        std::vector<int> open;
+        for (const auto& connection : loop.connections) {
+            open.push_back(connection.first);
+        }
+        for (int fd : open) {
+            closeConnection(*loop.connections[fd]);
+        }
+        // Handler-pool tasks hold on to the loop until they have posted their result
+        while (loop.offloaded > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        // Results that arrived too late find their connections gone, which closes
+        // any file they carry
+        LoopTask task;
+        while (loop.mailbox.pop(task)) {
+            task(loop);
+        }
+        loop.mailbox.finishBatch();
+        if (loop.readerSlot != -1) {
+            requestHandler.readers().unregisterReader(loop.readerSlot);
+        }
+        std::lock_guard<std::mutex> lock(loopsMutex);
+        loops.erase(std::find(loops.begin(), loops.end(), &loop));
+    }
+
+    void wakeLoops() {
+        std::lock_guard<std::mutex> lock(loopsMutex);
+        for (EventLoop* loop : loops) {
+            loop->wake();
+        }
+    }
+
+    // Takes the listeners out of this loop and closes its idle connections; the
+    // others are closed as they finish (see flush).
+    void beginDrain(EventLoop& loop) {
+        if (loop.draining) {
+            return;
+        }
+        loop.draining = true;
+        for (const auto& listener : listeners) {
+            epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, listener.fd, nullptr);
+        }
+        std::vector<int> idle;
+        for (const auto& connection : loop.connections) {
+            if (isIdle(*connection.second)) {
+                idle.push_back(connection.first);
+            }
+        }
+        for (int fd : idle) {
+            closeConnection(*loop.connections[fd]);
+        }
+        log("INFO", "HttpServer", "beginDrain", "Draining", "Connections left: " + std::to_string(loop.connections.size()));
+    }
+
+    // Runs tasks posted to the loop, a bounded batch per iteration so that a flood
+    // of them cannot starve the connections.
+    void drainMailbox(EventLoop& loop) {
+        LoopTask task;
+        for (int count = 0; count < MAILBOX_BATCH && loop.mailbox.pop(task); ++count) {
+            task(loop);
+        }
+        if (loop.mailbox.finishBatch()) {
+            loop.wake();
+        }
+    }
+
+    static bool isIdle(const Connection& connection) {
+        return connection.sendQueue.empty() && connection.input.empty() && !connection.upload && !connection.handlerPending;
+    }
+
+    bool openListener(Listener& listener) {
+        const std::string& spec = listener.address.spec;
+        struct sockaddr_storage address;
+        socklen_t addressLength = 0;
+        if (!resolveListenAddress(spec, address, addressLength)) {
+            log("ERROR", "HttpServer", "initialize", "Invalid listen address", spec);
+            return false;
+        }
+
+        listener.fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener.fd == -1) {
+            log("ERROR", "HttpServer", "initialize", "Socket creation", "failed: " + spec);
+            return false;
+        }
+
+        int opt = 1;
+        if (address.ss_family == AF_UNIX) {
+            // A socket file left behind by a previous run would make bind fail
+            const auto* unixAddress = reinterpret_cast<const struct sockaddr_un*>(&address);
+            if (unixAddress->sun_path[0] != '\0' && !removeStaleSocket(unixAddress->sun_path, address, addressLength)) {
+                return false;
+            }
+        } else if (setsockopt(listener.fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+            log("ERROR", "HttpServer", "initialize", "Setting socket options", "failed: " + spec);
+            return false;
+        }
+        if (address.ss_family == AF_INET6) {
+            int v6Only = 0;
+            setsockopt(listener.fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6Only, sizeof(v6Only));
+        }
+
+        if (bind(listener.fd, reinterpret_cast<struct sockaddr*>(&address), addressLength) == -1) {
+            log("ERROR", "HttpServer", "initialize", "Binding socket", "failed: " + spec + ": " + strerror(errno));
+            return false;
+        }
+
+        if (listen(listener.fd, backlog) == -1) {
+            log("ERROR", "HttpServer", "initialize", "Listening on socket", "failed: " + spec);
+            return false;
+        }
+        log("INFO", "HttpServer", "initialize", "Listening", spec + (listener.address.proxyProtocol ? " (PROXY protocol)" : "") + (listener.address.admin ? " (admin)" : ""));
+        return true;
+    }
+
+    // Removes a unix socket at `path` that nobody listens on any more. Fails for
+    // anything else there: a file that is not a socket, or one still in use.
+    static bool removeStaleSocket(const char* path, const struct sockaddr_storage& address, socklen_t addressLength) {
+        struct stat fileStat;
+        if (lstat(path, &fileStat) == -1) {
+            return true;
+        }
+        if (!S_ISSOCK(fileStat.st_mode)) {
+            log("ERROR", "HttpServer", "initialize", "Listen path exists and is not a socket", path);
+            return false;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool inUse = probe != -1 && connect(probe, reinterpret_cast<const struct sockaddr*>(&address), addressLength) == 0;
+        if (probe != -1) {
+            close(probe);
+        }
+        if (inUse) {
+            log("ERROR", "HttpServer", "initialize", "Listen socket already in use", path);
+            return false;
+        }
+        unlink(path);
+        return true;
+    }
+
+    // Milliseconds epoll_wait may block before a timer needs servicing.
+    int nextTimeout(const EventLoop& loop) const {
+        if (!loop.readyList.empty()) {
+            return 0;
+        }
+        auto until = [](std::chrono::steady_clock::time_point deadline) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            return static_cast<int>(std::max<long long>(0, left + 1));
+        };
+        int timeout = -1;
+        auto wakeBy = [&timeout](int candidate) {
+            if (candidate >= 0 && (timeout < 0 || candidate < timeout)) {
+                timeout = candidate;
+            }
+        };
+        if (!loop.lingering.empty()) {
+            wakeBy(until(loop.lingering.front().first));
+        }
+        if (!loop.connections.empty()) {
+            wakeBy(until(loop.nextDeadlineCheck));
+        }
+        if (loop.primary) {
+            wakeBy(until(loop.nextAssetCheck));
+        }
+        return timeout;
+    }
+
+    Listener* findListener(int fd) {
+        for (auto& listener : listeners) {
+            if (listener.fd == fd) {
+                return &listener;
+            }
+        }
+        return nullptr;
+    }
+
+    void acceptConnections(EventLoop& loop, Listener& listener) {
+        while (true) {
+            struct sockaddr_storage peer;
+            socklen_t peerLength = sizeof(peer);
+            int client_socket = accept4(listener.fd, reinterpret_cast<struct sockaddr*>(&peer), &peerLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    log("ERROR", "HttpServer", "run", "Accepting connection", "failed");
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+
+            bool priority = listener.address.admin;
+            if (!priority && maxConnections > 0 && regularConnections >= maxConnections) {
+                shedConnection(client_socket);
+                continue;
+            }
+
+            // Responses are already coalesced per iteration, Nagle would only delay the batch
+            if (peer.ss_family != AF_UNIX) {
+                int noDelay = 1;
+                setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            }
+            bool tuned = socketTuning && peer.ss_family != AF_UNIX;
+
+            // Edge-triggered on both directions, so the interest set never has to be modified
+            struct epoll_event event = {};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.u64 = eventKey(client_socket, priority);
+            if (epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, client_socket, &event) == -1) {
+                log("ERROR", "HttpServer", "acceptConnections", "Registering connection", "failed");
+                close(client_socket);
+                continue;
+            }
+            auto connection = std::make_unique<Connection>(client_socket, &socketTransport, formatAddress(reinterpret_cast<struct sockaddr*>(&peer)));
+            connection->tunedBuffers = tuned;
+            connection->awaitingProxyHeader = listener.address.proxyProtocol;
+            connection->listener = &listener;
+            connection->priority = priority;
+            connection->loop = &loop;
+            connection->id = ++lastConnectionId;
+            connection->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HEADER_TIMEOUT_MS);
+            loop.connections[client_socket] = std::move(connection);
+            ++openConnections;
+            ++listener.accepted;
+            ++listener.active;
+            if (!priority) {
+                ++regularConnections;
+            }
+        }
+    }
+
+    // Turns away a connection accepted while the server is at capacity. The 503 is
+    // best effort: a fresh socket has an empty send buffer, so it normally fits.
+    void shedConnection(int client_socket) {
+        static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+        send(client_socket, response, sizeof(response) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(client_socket);
+        if (shedCount++ % 1000 == 0) {
+            log("WARN", "HttpServer", "acceptConnections", "At capacity, shedding connections", "Shed so far: " + std::to_string(shedCount));
+        }
+    }
+
+    void onReadable(Connection& connection) {
+        if (connection.lingering) {
+            discardInput(connection);
+            return;
+        }
+        char buffer[READ_BUFFER_SIZE];
+        int fd = connection.fd;
+
+        // Requests left buffered by an earlier pause are answered before reading more
+        if (!processInput(connection)) {
+            return;
+        }
+        while (!connection.readPaused && !connection.handlerPending && !connection.peerClosed && !connection.closeAfterFlush) {
+            // Reading on after the request budget ran out would only grow the input buffer
+            if (connection.readBudget == 0 || connection.requestBudget == 0) {
+                markReady(connection);
+                break;
+            }
+            ssize_t received = connection.transport->receive(fd, buffer, sizeof(buffer));
+            if (received > 0) {
+                connection.readBudget -= std::min<size_t>(connection.readBudget, received);
+                connection.receivedBytes += received;
+                // Upload bodies bypass the input buffer and go straight to the parser
+                size_t consumed = 0;
+                if (connection.upload && connection.input.empty()) {
+                    consumed = feedUpload(connection, buffer, received);
+                }
+                connection.input.append(buffer + consumed, received - consumed);
+                if (!processInput(connection)) {
+                    return;
+                }
+                continue;
+            }
+            if (received == 0) {
+                connection.peerClosed = true;
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(connection);
+                return;
+            }
+            break;
+        }
+
+        updateDeadline(connection);
+        connection.account();
+        scheduleFlush(connection);
+    }
+
+    // Restarts the connection's deadline when what it waits for changes: the next
+    // request while idle, the rest of a request head, or the rest of a body, which
+    // must keep arriving at MIN_BODY_RATE. No deadline runs while the server owes
+    // the client a response.
+    static void updateDeadline(Connection& connection) {
+        if (connection.handlerPending || !connection.sendQueue.empty() || connection.closeAfterFlush || connection.lingering) {
+            connection.waiting = ConnectionWait::None;
+            return;
+        }
+        ConnectionWait waiting = ConnectionWait::Idle;
+        if (connection.upload) {
+            waiting = ConnectionWait::Body;
+        } else if (!connection.input.empty()) {
+            waiting = connection.input.find("\r\n\r\n") == std::string::npos ? ConnectionWait::Header : ConnectionWait::Body;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (waiting == ConnectionWait::Body) {
+            if (connection.waiting != ConnectionWait::Body) {
+                connection.bodyStarted = now;
+                connection.bodyMark = connection.receivedBytes;
+            }
+            uint64_t allowance = (connection.receivedBytes - connection.bodyMark) * 1000 / MIN_BODY_RATE;
+            connection.deadline = connection.bodyStarted + std::chrono::milliseconds(BODY_TIMEOUT_MS + allowance);
+        } else if (waiting != connection.waiting) {
+            connection.deadline = now + std::chrono::milliseconds(waiting == ConnectionWait::Idle ? KEEPALIVE_TIMEOUT_MS : HEADER_TIMEOUT_MS);
+        }
+        connection.waiting = waiting;
+    }
+
+    // Closes idle connections whose deadline passed and answers 408 to those
+    // stuck partway through a request. Checked every DEADLINE_CHECK_INTERVAL_MS,
+    // so a deadline may run over by that much.
+    void expireDeadlines(EventLoop& loop) {
+        auto now = std::chrono::steady_clock::now();
+        if (now < loop.nextDeadlineCheck) {
+            return;
+        }
+        loop.nextDeadlineCheck = now + std::chrono::milliseconds(DEADLINE_CHECK_INTERVAL_MS);
+        std::vector<int> expired;
+        for (const auto& entry : loop.connections) {
+            if (entry.second->waiting != ConnectionWait::None && entry.second->deadline <= now) {
+                expired.push_back(entry.first);
+            }
+        }
+        for (int fd : expired) {
+            Connection& connection = *loop.connections[fd];
+            if (connection.waiting == ConnectionWait::Idle || (connection.input.empty() && !connection.upload)) {
+                log("INFO", "HttpServer", "expireDeadlines", "Idle connection timed out", "fd: " + std::to_string(fd));
+                closeConnection(connection);
+                continue;
+            }
+            connection.upload.reset();
+            connection.waiting = ConnectionWait::None;
+            rejectRequest(connection, STATUS_REQUEST_TIMEOUT, "Request timed out");
+            scheduleFlush(connection);
+        }
+    }
+
+    // Parses and answers every complete request buffered on the connection until
+    // the output backs up past the high watermark or the request budget runs out.
+    // Returns false if the connection was closed.
+    bool processInput(Connection& connection) {
+        refreshBudget(connection);
+        if (connection.awaitingProxyHeader) {
+            if (!readProxyHeader(connection)) {
+                return false;
+            }
+            if (connection.awaitingProxyHeader) {
+                return true;
+            }
+        }
+
+        while (!connection.readPaused && !connection.handlerPending && !connection.closeAfterFlush) {
+            if (connection.upload) {
+                size_t consumed = feedUpload(connection, connection.input.data(), connection.input.size());
+                connection.input.erase(0, consumed);
+                if (connection.upload) {
+                    return true;
+                }
+                continue;
+            }
+
+            if (connection.requestBudget == 0) {
+                if (!connection.input.empty()) {
+                    markReady(connection);
+                }
+                return true;
+            }
+            if (!fastPaths.empty() && answerFastPath(connection)) {
+                --connection.requestBudget;
+                continue;
+            }
+
+            size_t headerEnd = connection.input.find("\r\n\r\n");
+            if (headerEnd == std::string::npos) {
+                if (connection.input.size() > MAX_HEADER_SIZE) {
+                    return rejectRequest(connection, STATUS_BAD_REQUEST, "Request header too large");
+                }
+                return true;
+            }
+            headerEnd += 4;
+
+            // Bodies are only framed by Content-Length; anything else could be read
+            // differently by a proxy in front, so the connection is not reused
+            size_t contentLength = 0;
+            if (findHeaderLine(connection.input, headerEnd, "transfer-encoding") != std::string::npos) {
+                return rejectRequest(connection, STATUS_NOT_IMPLEMENTED, "Transfer-Encoding not supported");
+            }
+            if (!parseContentLength(connection.input, headerEnd, contentLength)) {
+                return rejectRequest(connection, STATUS_BAD_REQUEST, "Invalid Content-Length");
+            }
+            if (contentLength > 0 && !connection.bodyChecked) {
+                connection.bodyChecked = true;
+                if (startUpload(connection, headerEnd, contentLength)) {
+                    continue;
+                }
+            }
+            if (contentLength > MAX_BODY_SIZE) {
+                return rejectRequest(connection, STATUS_PAYLOAD_TOO_LARGE, "Request body too large");
+            }
+            if (connection.input.size() < headerEnd + contentLength) {
+                return true;
+            }
+
+            Request request(connection.input.substr(0, headerEnd + contentLength));
+            connection.input.erase(0, headerEnd + contentLength);
+            connection.bodyChecked = false;
+            --connection.requestBudget;
+            answer(connection, request);
+        }
+        return true;
+    }
+
+    // Consumes the PROXY header that must precede the first request on proxied
+    // listeners. Returns false if the connection was closed.
+    bool readProxyHeader(Connection& connection) {
+        if (connection.input.empty()) {
+            return true;
+        }
+        size_t consumed = 0;
+        std::string clientAddress;
+        switch (parseProxyHeader(connection.input, consumed, clientAddress)) {
+            case ProxyHeaderResult::Incomplete:
+                return true;
+            case ProxyHeaderResult::Invalid:
+                log("ERROR", "HttpServer", "readProxyHeader", "Invalid PROXY header", "Peer: " + connection.peerAddress);
+                closeConnection(connection);
+                return false;
+            case ProxyHeaderResult::Parsed:
+                break;
+        }
+        if (!clientAddress.empty()) {
+            connection.peerAddress = clientAddress;
+        }
+        connection.input.erase(0, consumed);
+        connection.awaitingProxyHeader = false;
+        return true;
+    }
+
+    // Answers the buffered request from the fast-path table if its request line
+    // matches one exactly and it carries no body. Returns true if it was answered.
+    bool answerFastPath(Connection& connection) {
+        const std::string& input = connection.input;
+        for (const auto& fastPath : fastPaths) {
+            size_t lineLength = fastPath.requestLine.size();
+            if (input.size() < lineLength || memcmp(input.data(), fastPath.requestLine.data(), lineLength) != 0) {
+                continue;
+            }
+            size_t headerEnd = input.find("\r\n\r\n", lineLength - 2);
+            size_t contentLength = 0;
+            if (headerEnd == std::string::npos || !parseContentLength(input, headerEnd + 4, contentLength) || contentLength > 0
+                    || findHeaderLine(input, headerEnd + 4, "transfer-encoding") != std::string::npos) {
+                return false;
+            }
+            headerEnd += 4;
+
+            // HTTP/1.0 fast paths are serialized with "Connection: close" already
+            bool keepAlive = fastPath.response != fastPath.closeResponse && !hasConnectionClose(input, headerEnd);
+            SendSegment segment;
+            segment.staticData = keepAlive ? fastPath.response : fastPath.closeResponse;
+            connection.queuedBytes += segment.staticData.size();
+            connection.sendQueue.push_back(std::move(segment));
+            if (!keepAlive) {
+                connection.closeAfterFlush = true;
+            }
+            connection.input.erase(0, headerEnd);
+            return true;
+        }
+        return false;
+    }
+
+    static bool hasConnectionClose(const std::string& input, size_t headerEnd) {
+        static const char header[] = "\r\nconnection:";
+        size_t headerLength = sizeof(header) - 1;
+        for (size_t pos = input.find("\r\n"); pos != std::string::npos && pos + headerLength < headerEnd; pos = input.find("\r\n", pos + 2)) {
+            if (strncasecmp(input.c_str() + pos, header, headerLength) == 0) {
+                size_t value = input.find_first_not_of(" \t", pos + headerLength);
+                return value != std::string::npos && strncasecmp(input.c_str() + value, "close", 5) == 0;
+            }
+        }
+        return false;
+    }
+
+    void answer(Connection& connection, Request& request) {
+        request.clientAddress = connection.peerAddress;
+        log("INFO", "HttpServer", "run", "Request received", "Path: " + std::string(request.path) + ", Client: " + request.clientAddress);
+
+        bool adminRoute = connection.priority && request.path.compare(0, 7, "/admin/") == 0;
+        bool keepAlive = isKeepAlive(request) && !draining;
+        bool cacheable = !adminRoute && request.method == "GET" && findHeader(request.headers, "If-None-Match").empty();
+        uint64_t generation = requestHandler.generation();
+        HotCache& hotCache = connection.loop->hotCache;
+        const HotCache::Entry* hot = cacheable ? hotCache.find(request.path, generation) : nullptr;
+        auto preflight = adminRoute || hot ? nullptr : requestHandler.preflightResponse(request, keepAlive);
+        std::unique_ptr<TrafficCapture::Record> sampled;
+        if (capture && !adminRoute && capture->sample()) {
+            sampled = std::make_unique<TrafficCapture::Record>(capture->begin(request));
+        }
+        int status;
+        if (hot) {
+            status = prerenderedStatus(*hot->response);
+            queuePrerendered(connection, keepAlive ? hot->response : hot->closeResponse, keepAlive);
+        } else if (preflight) {
+            status = prerenderedStatus(*preflight);
+            queuePrerendered(connection, std::move(preflight), keepAlive);
+        } else if (adminRoute && (request.path == "/admin/profile" || request.path == "/admin/heap")) {
+            profile(connection, request, keepAlive);
+            status = 0;
+        } else if (!adminRoute && handlerPool && requestHandler.offloaded(request)) {
+            // Recorded once the handler pool has answered
+            offload(connection, request, keepAlive, std::move(sampled));
+            status = 0;
+        } else {
+            Response response = adminRoute ? handleAdminRequest(request) : requestHandler.handleRequest(request);
+            if (cacheable && response.shareable && response.contentLength() <= HOT_CACHE_MAX_OBJECT && hotCache.wants(request.path)) {
+                hotCache.insert(request.path, renderResponse(response, true, MEMORY_HOT_CACHE), renderResponse(response, false, MEMORY_HOT_CACHE));
+            }
+            status = response.code;
+            queueResponse(connection, response, keepAlive);
+        }
+        if (sampled) {
+            capture->record(std::move(*sampled), status);
+        }
+
+        if (connection.queuedBytes > SEND_HIGH_WATERMARK) {
+            connection.readPaused = true;
+            log("WARN", "HttpServer", "processInput", "Output backed up, pausing reads", "Queued: " + std::to_string(connection.queuedBytes));
+        }
+    }
+
+    // Hands the request to the handler pool. The connection answers nothing else
+    // until the response has been posted back to its loop, keeping pipelined
+    // responses in order.
+    void offload(Connection& connection, Request& request, bool keepAlive, std::unique_ptr<TrafficCapture::Record> sampled) {
+        // Requests cannot move (their views point into `raw`), so the task gets its own copy
+        auto task = std::make_shared<Request>(request.raw);
+        task->clientAddress = request.clientAddress;
+        task->formFields = std::move(request.formFields);
+        task->uploadedFiles = std::move(request.uploadedFiles);
+        task->uploadSink = std::move(request.uploadSink);
+
+        EventLoop* loop = connection.loop;
+        int fd = connection.fd;
+        uint64_t id = connection.id;
+        std::shared_ptr<TrafficCapture::Record> record = std::move(sampled);
+        connection.handlerPending = true;
+        ++loop->offloaded;
+        bool submitted = handlerPool->submit([this, loop, fd, id, task, keepAlive, record](bool expired) {
+            Response response = expired ? overloadedResponse() : requestHandler.handleRequest(*task);
+            if (record) {
+                capture->record(std::move(*record), response.code);
+            }
+            postCompletion(loop, fd, id, std::move(response), keepAlive);
+        }, connection.priority);
+        if (!submitted) {
+            --loop->offloaded;
+            connection.handlerPending = false;
+            Response response = overloadedResponse();
+            if (record) {
+                capture->record(std::move(*record), response.code);
+            }
+            queueResponse(connection, response, keepAlive);
+        }
+    }
+
+    // Answers GET /admin/profile?seconds=N&hz=N with folded CPU stacks, and
+    // GET /admin/heap?seconds=N&bytes=N[&format=folded] with the allocation call
+    // sites, once the profile is done. Sampling runs on its own thread so the
+    // loop keeps serving.
+    void profile(Connection& connection, const Request& request, bool keepAlive) {
+        long seconds = std::clamp(strtol(request.queryParam("seconds").c_str(), nullptr, 10), 1L, static_cast<long>(PROFILE_MAX_SECONDS));
+        bool heap = request.path == "/admin/heap";
+        std::string hzParam = request.queryParam("hz");
+        int hz = hzParam.empty() ? PROFILE_DEFAULT_HZ : atoi(hzParam.c_str());
+        std::string bytesParam = request.queryParam("bytes");
+        size_t sampleBytes = bytesParam.empty() ? HEAP_PROFILE_SAMPLE_BYTES : strtoul(bytesParam.c_str(), nullptr, 10);
+        bool folded = request.queryParam("format") == "folded";
+        if (heap && !HeapProfiler::available()) {
+            Response response = {STATUS_SERVICE_UNAVAILABLE, "Built without CHIPPORT_HEAP_PROFILER\n", "text/plain"};
+            queueResponse(connection, response, keepAlive);
+            return;
+        }
+
+        EventLoop* loop = connection.loop;
+        int fd = connection.fd;
+        uint64_t id = connection.id;
+        connection.handlerPending = true;
+        ++loop->offloaded;
+        std::thread([this, loop, fd, id, seconds, heap, hz, sampleBytes, folded, keepAlive] {
+            Response response = {STATUS_SERVICE_UNAVAILABLE, "A profile is already running\n", "text/plain"};
+            if (!heap) {
+                std::string stacks;
+                bool profiled = Profiler::profile(std::chrono::seconds(seconds), hz, stopping, stacks);
+                response = {profiled ? STATUS_SUCCESS : STATUS_SERVICE_UNAVAILABLE, std::move(stacks), "text/plain"};
+            } else if (HeapProfiler::start(sampleBytes)) {
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+                while (!stopping && std::chrono::steady_clock::now() < deadline) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                response = {STATUS_SUCCESS, HeapProfiler::stop(0, folded), "text/plain"};
+            }
+            postCompletion(loop, fd, id, std::move(response), keepAlive);
+        }).detach();
+    }
+
+    // Any thread. Hands the response for an offloaded request back to the
+    // connection's loop and releases the loop.
+    void postCompletion(EventLoop* loop, int fd, uint64_t id, Response response, bool keepAlive) {
+        auto shared = std::make_shared<Response>(std::move(response));
+        if (!loop->post([this, fd, id, shared, keepAlive](EventLoop& loop) { completeOffload(loop, fd, id, *shared, keepAlive); })) {
+            log("ERROR", "HttpServer", "postCompletion", "Mailbox full, response lost", "fd: " + std::to_string(fd));
+            if (shared->fileFd >= 0) {
+                close(shared->fileFd);
+            }
+        }
+        --loop->offloaded;
+    }
+
+    // Runs on the connection's loop once its offloaded request was handled.
+    void completeOffload(EventLoop& loop, int fd, uint64_t id, Response& response, bool keepAlive) {
+        auto it = loop.connections.find(fd);
+        if (it == loop.connections.end() || it->second->id != id) {
+            // Closed while the handler ran; a file response must not leak its descriptor
+            if (response.fileFd >= 0) {
+                close(response.fileFd);
+            }
+            return;
+        }
+        Connection& connection = *it->second;
+        connection.handlerPending = false;
+        queueResponse(connection, response, keepAlive);
+        if (connection.queuedBytes > SEND_HIGH_WATERMARK) {
+            connection.readPaused = true;
+        }
+        // Pipelined requests that arrived meanwhile, and with edge-triggered epoll
+        // any data that was left unread
+        onReadable(connection);
+    }
+
+    // Status code of a response serialized ahead of time ("HTTP/1.1 200 OK...").
+    static int prerenderedStatus(const std::string& rendered) {
+        return rendered.size() > 12 ? atoi(rendered.c_str() + 9) : 0;
+    }
+
+    static Response overloadedResponse() {
+        Response response = {STATUS_SERVICE_UNAVAILABLE, "<html><body>503 Service Unavailable</body></html>", "text/html"};
+        response.headers.emplace_back("Retry-After", "1");
+        return response;
+    }
+
+    // Operational endpoints, only reachable through admin listeners.
+    Response handleAdminRequest(const Request& request) {
+        if (request.path == "/admin/stats") {
+            std::ostringstream stats;
+            stats << "connections " << openConnections << "\n"
+                  << "shed " << shedCount << "\n";
+            if (handlerPool) {
+                stats << "handler_queue " << handlerPool->queued << " codel_dropped " << handlerPool->dropped
+                      << " rejected " << handlerPool->rejected << "\n";
+            }
+            if (capture) {
+                stats << "capture_records " << capture->captured << " capture_dropped " << capture->dropped << "\n";
+            }
+            {
+                std::lock_guard<std::mutex> lock(loopsMutex);
+                for (size_t i = 0; i < loops.size(); ++i) {
+                    uint64_t hits = loops[i]->hotCache.hits.load(std::memory_order_relaxed);
+                    uint64_t misses = loops[i]->hotCache.misses.load(std::memory_order_relaxed);
+                    stats << "loop " << i << " hot_cache_hits " << hits << " misses " << misses
+                          << " hit_ratio " << (hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0) << "\n";
+                }
+            }
+            for (const auto& listener : listeners) {
+                stats << "listener " << listener.address.spec << " accepted " << listener.accepted << " active " << listener.active << "\n";
+            }
+            std::vector<int64_t> memory = MemoryAccount::totals();
+            for (int tag = 0; tag < MEMORY_TAG_COUNT; ++tag) {
+                stats << "memory_" << memoryTagName(static_cast<MemoryTag>(tag)) << " " << memory[tag] << "\n";
+            }
+            return {STATUS_SUCCESS, stats.str(), "text/plain"};
+        }
+        if (request.path == "/admin/memory") {
+            // Accounted bytes per subsystem against the resident set, so the unaccounted rest shows too
+            std::vector<int64_t> memory = MemoryAccount::totals();
+            std::ostringstream breakdown;
+            int64_t accounted = 0;
+            for (int tag = 0; tag < MEMORY_TAG_COUNT; ++tag) {
+                breakdown << memoryTagName(static_cast<MemoryTag>(tag)) << " " << memory[tag] << "\n";
+                accounted += memory[tag];
+            }
+            long pages = 0;
+            std::ifstream statm("/proc/self/statm");
+            statm >> pages >> pages;
+            int64_t resident = static_cast<int64_t>(pages) * sysconf(_SC_PAGESIZE);
+            breakdown << "accounted " << accounted << "\n"
+                      << "resident " << resident << "\n"
+                      << "unaccounted " << resident - accounted << "\n";
+            return {STATUS_SUCCESS, breakdown.str(), "text/plain"};
+        }
+        log("ERROR", "handleAdminRequest", "Route not found", "No admin route for", std::string(request.path));
+        return {STATUS_NOT_FOUND, "<html><body>404 Route Not Found: " + std::string(request.target) + "</body></html>", "text/html"};
+    }
+
+    // Switches the connection to streaming the body through a multipart parser if
+    // the request is an upload to a route that takes them. The route is looked up
+    // from the raw request line, so only uploads are parsed here and every other
+    // body is parsed once, when it is complete.
+    bool startUpload(Connection& connection, size_t headerEnd, size_t contentLength) {
+        const std::string& input = connection.input;
+        std::string boundary = multipartBoundary(headerValue(input, findHeaderLine(input, headerEnd, "content-type")));
+        if (boundary.empty()) {
+            return false;
+        }
+        std::string_view requestLine(input.data(), input.find("\r\n"));
+        size_t methodEnd = requestLine.find(' ');
+        if (methodEnd == std::string_view::npos) {
+            return false;
+        }
+        std::string_view target = requestLine.substr(methodEnd + 1);
+        target = target.substr(0, target.find(' '));
+        std::shared_ptr<const std::string> normalized;
+        std::string_view path = normalizePath(target.substr(0, target.find('?')), normalized);
+        const RouteEntry* route = requestHandler.uploadRoute(requestLine.substr(0, methodEnd), path);
+        if (!route) {
+            return false;
+        }
+        if (contentLength > route->maxUploadSize) {
+            return rejectRequest(connection, STATUS_PAYLOAD_TOO_LARGE, "Upload too large");
+        }
+
+        auto upload = std::make_unique<Upload>();
+        upload->request = std::make_unique<Request>(input.substr(0, headerEnd));
+        if (route->uploadSink) {
+            upload->sink = route->uploadSink(*upload->request);
+            if (!upload->sink) {
+                return rejectRequest(connection, STATUS_INTERNAL_SERVER_ERROR, "Upload refused by route");
+            }
+        } else {
+            auto spooler = std::make_shared<UploadSpooler>(route->uploadDirectory, route->keepUploads);
+            upload->spooler = spooler.get();
+            upload->sink = std::move(spooler);
+        }
+        upload->parser = std::make_unique<MultipartParser>(boundary, *upload->sink);
+        upload->remaining = contentLength;
+        if (strcasecmp(headerValue(input, findHeaderLine(input, headerEnd, "expect")).c_str(), "100-continue") == 0) {
+            SendSegment interim;
+            interim.data = "HTTP/1.1 100 Continue\r\n\r\n";
+            connection.queuedBytes += interim.data.size();
+            connection.sendQueue.push_back(std::move(interim));
+            scheduleFlush(connection);
+        }
+        log("INFO", "HttpServer", "startUpload", "Streaming upload", "Path: " + std::string(path) + ", Length: " + std::to_string(contentLength));
+
+        connection.upload = std::move(upload);
+        connection.input.erase(0, headerEnd);
+        connection.bodyChecked = false;
+        return true;
+    }
+
+    // Feeds upload body bytes to the parser, answering the request once the whole
+    // body has arrived. Returns how many bytes belonged to the body.
+    size_t feedUpload(Connection& connection, const char* data, size_t length) {
+        Upload& upload = *connection.upload;
+        size_t take = std::min(length, upload.remaining);
+        if (!upload.parser->feed(data, take)) {
+            int code = upload.sink->errorStatus ? upload.sink->errorStatus : STATUS_BAD_REQUEST;
+            connection.upload.reset();
+            rejectRequest(connection, code, "Upload failed");
+            return length;
+        }
+        upload.remaining -= take;
+        if (upload.remaining > 0) {
+            return take;
+        }
+
+        if (!upload.parser->finished()) {
+            connection.upload.reset();
+            rejectRequest(connection, STATUS_BAD_REQUEST, "Truncated multipart body");
+            return length;
+        }
+        std::unique_ptr<Upload> finished = std::move(connection.upload);
+        if (finished->spooler) {
+            finished->spooler->commit();
+            finished->request->formFields = std::move(finished->spooler->fields);
+            finished->request->uploadedFiles = finished->spooler->files;
+        }
+        finished->request->uploadSink = std::move(finished->sink);
+        answer(connection, *finished->request);
+        return take;
+    }
+
+    // Answers with `code` and closes once it is sent. Whatever the client still
+    // sends is drained first, since closing with unread input makes the kernel
+    // reset the connection before the client has read the answer.
+    bool rejectRequest(Connection& connection, int code, const std::string& reason) {
+        log("ERROR", "HttpServer", "processInput", reason, "fd: " + std::to_string(connection.fd));
+        Response response = {code, "<html><body>" + std::to_string(code) + " " + getStatusText(code) + "</body></html>", "text/html"};
+        connection.input.clear();
+        connection.lingerOnClose = true;
+        queueResponse(connection, response, false);
+        return true;
+    }
+
+    // Shuts down writes and keeps reading until the client closes too, for at most
+    // LINGER_TIMEOUT_MS and LINGER_MAX_BYTES.
+    void startLinger(Connection& connection) {
+        EventLoop& loop = *connection.loop;
+        shutdown(connection.fd, SHUT_WR);
+        connection.lingering = true;
+        connection.lingerBudget = LINGER_MAX_BYTES;
+        loop.lingering.emplace_back(std::chrono::steady_clock::now() + std::chrono::milliseconds(LINGER_TIMEOUT_MS), connection.id);
+        loop.lingeringFds[connection.id] = connection.fd;
+        discardInput(connection);
+    }
+
+    // Returns false if the connection was closed.
+    bool discardInput(Connection& connection) {
+        char buffer[READ_BUFFER_SIZE];
+        while (true) {
+            ssize_t received = connection.transport->receive(connection.fd, buffer, sizeof(buffer));
+            if (received > 0 && static_cast<size_t>(received) < connection.lingerBudget) {
+                connection.lingerBudget -= received;
+                continue;
+            }
+            if (received == -1 && errno == EINTR) {
+                continue;
+            }
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            closeConnection(connection);
+            return false;
+        }
+    }
+
+    // Closes lingering connections whose deadline passed.
+    void expireLingering(EventLoop& loop) {
+        auto now = std::chrono::steady_clock::now();
+        while (!loop.lingering.empty() && loop.lingering.front().first <= now) {
+            auto entry = loop.lingeringFds.find(loop.lingering.front().second);
+            loop.lingering.pop_front();
+            if (entry == loop.lingeringFds.end()) {
+                continue;
+            }
+            auto connection = loop.connections.find(entry->second);
+            if (connection != loop.connections.end() && connection->second->id == entry->first) {
+                closeConnection(*connection->second);
+            }
+        }
+    }
+
+    // Offset of the value of the first header named `name` (lower case) at or
+    // after `from`, npos if there is none before `headerEnd`.
+    static size_t findHeaderLine(const std::string& input, size_t headerEnd, const char* name, size_t from = 0) {
+        size_t nameLength = strlen(name);
+        for (size_t pos = input.find("\r\n", from); pos != std::string::npos && pos + 2 + nameLength < headerEnd; pos = input.find("\r\n", pos + 2)) {
+            if (strncasecmp(input.c_str() + pos + 2, name, nameLength) == 0 && input[pos + 2 + nameLength] == ':') {
+                return pos + 3 + nameLength;
+            }
+        }
+        return std::string::npos;
+    }
+
+    // Value of the header line at `pos` (from findHeaderLine), empty for npos.
+    static std::string headerValue(const std::string& input, size_t pos) {
+        if (pos == std::string::npos) {
+            return "";
+        }
+        pos = input.find_first_not_of(" \t", pos);
+        size_t end = input.find("\r\n", pos);
+        while (end > pos && (input[end - 1] == ' ' || input[end - 1] == '\t')) {
+            --end;
+        }
+        return input.substr(pos, end - pos);
+    }
+
+    // Fails on an unparsable value and on repeated headers that disagree, since
+    // Request keeps only one of them.
+    static bool parseContentLength(const std::string& input, size_t headerEnd, size_t& contentLength) {
+        bool found = false;
+        for (size_t pos = findHeaderLine(input, headerEnd, "content-length"); pos != std::string::npos;
+                pos = findHeaderLine(input, headerEnd, "content-length", pos)) {
+            const char* value = input.c_str() + pos;
+            while (*value == ' ' || *value == '\t') {
+                ++value;
+            }
+            char* end = nullptr;
+            errno = 0;
+            unsigned long long parsed = strtoull(value, &end, 10);
+            if (end == value || !isdigit(static_cast<unsigned char>(*value)) || errno == ERANGE
+                    || (*end != '\r' && *end != ' ' && *end != '\t') || (found && parsed != contentLength)) {
+                return false;
+            }
+            contentLength = parsed;
+            found = true;
+        }
+        return true;
+    }
+
+    static bool isKeepAlive(const Request& request) {
+        std::string connectionHeader = findHeader(request.headers, "Connection");
+        if (request.httpVersion == "HTTP/1.0") {
+            return strcasecmp(connectionHeader.c_str(), "keep-alive") == 0;
+        }
+        return strcasecmp(connectionHeader.c_str(), "close") != 0;
+    }
+
+    void queueResponse(Connection& connection, Response& response, bool keepAlive) {
+        if (connection.tunedBuffers && !connection.largeSendBuffer && response.contentLength() >= LARGE_RESPONSE_SIZE) {
+            // Room for a fast reader's window in flight, while only unsent bytes below
+            // the low watermark wait in the kernel; EPOLLOUT asks for more just before
+            // the socket runs dry
+            connection.largeSendBuffer = true;
+            setSocketBuffer(connection.fd, SO_SNDBUF, LARGE_SOCKET_BUFFER);
+            int lowat = NOTSENT_LOWAT_BYTES;
+            setsockopt(connection.fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+        }
+        SendSegment header;
+        header.data = response.buildHeader(keepAlive);
+        connection.queuedBytes += header.data.size();
+        connection.sendQueue.push_back(std::move(header));
+
+        if (response.sharedBody && !response.sharedBody->empty()) {
+            SendSegment body;
+            body.owner = std::move(response.sharedBody);
+            body.staticData = *body.owner;
+            connection.queuedBytes += body.staticData.size();
+            connection.sendQueue.push_back(std::move(body));
+        } else if (response.fileFd < 0 && !response.body.empty()) {
+            SendSegment body;
+            body.data = std::move(response.body);
+            connection.queuedBytes += body.data.size();
+            connection.sendQueue.push_back(std::move(body));
+        } else if (response.fileFd >= 0 && response.fileSize == 0) {
+            close(response.fileFd);
+            response.fileFd = -1;
+        } else if (response.fileFd >= 0) {
+            SendSegment file;
+            file.fileFd = response.fileFd;
+            file.fileRemaining = response.fileSize;
+            response.fileFd = -1;
+            connection.queuedBytes += file.fileRemaining;
+            connection.sendQueue.push_back(std::move(file));
+        }
+        if (!keepAlive) {
+            connection.closeAfterFlush = true;
+        }
+    }
+
+    // Serializes a response, body included, the way queueResponse would send it.
+    std::shared_ptr<const std::string> renderResponse(const Response& response, bool keepAlive, MemoryTag tag) const {
+        return trackedString(tag, response.buildHeader(keepAlive) + (response.sharedBody ? *response.sharedBody : response.body));
+    }
+
+    // Queues a complete response serialized ahead of time, without copying it.
+    void queuePrerendered(Connection& connection, std::shared_ptr<const std::string> response, bool keepAlive) {
+        SendSegment segment;
+        segment.owner = std::move(response);
+        segment.staticData = *segment.owner;
+        connection.queuedBytes += segment.staticData.size();
+        connection.sendQueue.push_back(std::move(segment));
+        if (!keepAlive) {
+            connection.closeAfterFlush = true;
+        }
+    }
+
+    // The kernel doubles `size` for its bookkeeping and stops autotuning the buffer.
+    static void setSocketBuffer(int fd, int option, int size) {
+        if (setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size)) == -1) {
+            log("WARN", "HttpServer", "setSocketBuffer", "Sizing socket buffer", strerror(errno));
+        }
+    }
+
+    // Grants the connection fresh budgets on its first use in an iteration.
+    static void refreshBudget(Connection& connection) {
+        uint64_t iteration = connection.loop->iteration;
+        if (connection.budgetIteration != iteration) {
+            connection.budgetIteration = iteration;
+            connection.readBudget = READ_BUDGET_BYTES;
+            connection.requestBudget = REQUEST_BUDGET;
+            connection.writeBudget = WRITE_BUDGET_BYTES;
+        }
+    }
+
+    // Defers the rest of the connection's work to the next iteration.
+    static void markReady(Connection& connection) {
+        if (!connection.ready) {
+            connection.ready = true;
+            connection.loop->readyList.push_back(connection.fd);
+        }
+    }
+
+    // Resumes the connections that ran out of budget last iteration, reading,
+    // answering and writing as if epoll had reported them again.
+    void resumeReady(EventLoop& loop) {
+        std::vector<int> batch;
+        batch.swap(loop.readyList);
+        for (int fd : batch) {
+            auto it = loop.connections.find(fd);
+            if (it == loop.connections.end()) {
+                continue;
+            }
+            it->second->ready = false;
+            onReadable(*it->second);
+        }
+    }
+
+    void scheduleFlush(Connection& connection) {
+        if (!connection.flushScheduled) {
+            connection.flushScheduled = true;
+            EventLoop& loop = *connection.loop;
+            (connection.priority ? loop.pendingPriorityFlush : loop.pendingFlush).push_back(connection.fd);
+        }
+    }
+
+    // Runs once at the end of every event-loop iteration so that all responses a
+    // connection produced during the iteration leave in a single writev.
+    void flushPending(EventLoop& loop) {
+        while (!loop.pendingPriorityFlush.empty() || !loop.pendingFlush.empty()) {
+            // Resuming a paused connection can schedule it again, so work on a snapshot
+            std::vector<int> batch;
+            batch.swap(loop.pendingPriorityFlush.empty() ? loop.pendingFlush : loop.pendingPriorityFlush);
+            for (int fd : batch) {
+                auto it = loop.connections.find(fd);
+                if (it == loop.connections.end()) {
+                    continue;
+                }
+                it->second->flushScheduled = false;
+                flush(*it->second);
+            }
+        }
+    }
+
+    // Writes as much queued output as the socket and the write budget allow; the
+    // rest waits for EPOLLOUT or the next iteration. Consecutive buffer segments go
+    // out in one writev, file segments through sendfile. Returns false if the
+    // connection was closed.
+    bool flush(Connection& connection) {
+        refreshBudget(connection);
+        while (!connection.sendQueue.empty()) {
+            if (connection.writeBudget == 0) {
+                markReady(connection);
+                return true;
+            }
+            ssize_t written;
+            if (connection.sendQueue.front().isFile()) {
+                SendSegment& segment = connection.sendQueue.front();
+                written = connection.transport->sendFile(connection.fd, segment.fileFd, &segment.fileOffset, std::min(segment.fileRemaining, connection.writeBudget));
+            } else {
+                struct iovec iov[MAX_IOVECS];
+                int iovCount = 0;
+                for (auto it = connection.sendQueue.begin(); it != connection.sendQueue.end() && iovCount < MAX_IOVECS && !it->isFile(); ++it) {
+                    iov[iovCount].iov_base = const_cast<char*>(it->bytes()) + it->sent;
+                    iov[iovCount].iov_len = it->remaining();
+                    ++iovCount;
+                }
+                written = connection.transport->send(connection.fd, iov, iovCount);
+            }
+
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                closeConnection(connection);
+                return false;
+            }
+            if (written == 0 && connection.sendQueue.front().isFile()) {
+                // File shrank underneath us, the promised Content-Length can no longer be met
+                log("ERROR", "HttpServer", "flush", "File truncated while sending", "fd: " + std::to_string(connection.fd));
+                closeConnection(connection);
+                return false;
+            }
+
+            connection.queuedBytes -= written;
+            connection.writeBudget -= std::min<size_t>(connection.writeBudget, written);
+            consumeSegments(connection, written);
+
+            if (connection.readPaused && connection.queuedBytes <= SEND_LOW_WATERMARK) {
+                int fd = connection.fd;
+                EventLoop& loop = *connection.loop;
+                connection.readPaused = false;
+                log("INFO", "HttpServer", "flush", "Output drained, resuming reads", "fd: " + std::to_string(fd));
+                // Edge-triggered epoll will not report data that arrived while paused;
+                // whatever this produces is flushed by the next pass of flushPending
+                onReadable(connection);
+                return loop.connections.count(fd) != 0;
+            }
+        }
+
+        connection.account();
+        if (connection.closeAfterFlush && connection.lingerOnClose && !connection.peerClosed && connection.transport == &socketTransport) {
+            int fd = connection.fd;
+            EventLoop& loop = *connection.loop;
+            if (!connection.lingering) {
+                log("INFO", "HttpServer", "flush", "Response sent", "Draining input before closing fd: " + std::to_string(fd));
+                startLinger(connection);
+            }
+            return loop.connections.count(fd) != 0;
+        }
+        if (connection.closeAfterFlush || connection.peerClosed || (connection.loop->draining && isIdle(connection))) {
+            log("INFO", "HttpServer", "flush", "Response sent", "Closing fd: " + std::to_string(connection.fd));
+            closeConnection(connection);
+            return false;
+        }
+        if (connection.waiting == ConnectionWait::None) {
+            updateDeadline(connection);
+        }
+        return true;
+    }
+
+    static void consumeSegments(Connection& connection, size_t written) {
+        while (written > 0) {
+            SendSegment& segment = connection.sendQueue.front();
+            size_t consumed = std::min(written, segment.remaining());
+            if (segment.isFile()) {
+                // sendfile already advanced fileOffset
+                segment.fileRemaining -= consumed;
+            } else {
+                segment.sent += consumed;
+            }
+            written -= consumed;
+            if (segment.remaining() == 0) {
+                if (segment.isFile()) {
+                    close(segment.fileFd);
+                }
+                connection.sendQueue.pop_front();
+            }
+        }
+    }
+
+    void closeConnection(Connection& connection) {
+        int fd = connection.fd;
+        EventLoop& loop = *connection.loop;
+        if (connection.listener) {
+            --connection.listener->active;
+        }
+        if (!connection.priority) {
+            --regularConnections;
+        }
+        if (connection.transport == &socketTransport) {
+            epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        if (connection.lingering) {
+            loop.lingeringFds.erase(connection.id);
+        }
+        --openConnections;
+        loop.connections.erase(fd);
+    }
+
+    RequestHandler requestHandler;
+    SocketTransport socketTransport;
+    EventLoop loopback;                 // Owns loopback connections, driven by deliver() rather than run()
+    std::mutex loopsMutex;
+    std::vector<EventLoop*> loops;      // Loops inside run(), for stop() and drain() to wake
+    bool primaryTaken = false;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> draining{false};
+    std::deque<Listener> listeners;     // Deque so connections can point at their listener
+    std::deque<FastPath> fastPaths;     // Deque so queued segments can keep pointing into it
+    int backlog;
+    size_t maxConnections;              // Regular connections beyond this are shed, 0 for no limit
+    size_t handlerThreads = 0;
+    bool socketTuning = true;
+    std::unique_ptr<TrafficCapture> capture;    // Before handlerPool, whose last tasks still record into it
+    std::string capturePath;
+    std::unique_ptr<HandlerPool> handlerPool;   // After requestHandler, so it is stopped first
+    std::atomic<uint64_t> lastConnectionId{0};
+    std::atomic<size_t> regularConnections{0};
+    std::atomic<size_t> openConnections{0};
+    std::atomic<unsigned long> shedCount{0};
+};
+
+}  // namespace chipport
+
+#ifdef CHIPPORT_HEAP_PROFILER
+namespace chipport {
+
+// Replacement operator new, reporting to HeapProfiler. Sized and aligned delete
+// need no replacement: the defaults free() what malloc() returned.
+struct HeapProfilerHook {
+    HeapProfilerHook() {
+        HeapProfiler::markHooked();
+    }
+};
+static HeapProfilerHook heapProfilerHook;
+
+static void* profiledAllocate(size_t size, void* caller) {
+    void* allocated;
+    while ((allocated = malloc(size ? size : 1)) == nullptr) {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    HeapProfiler::onAllocation(size, caller);
+    return allocated;
+}
+
+}  // namespace chipport
+
+void* operator new(size_t size) {
+    return chipport::profiledAllocate(size, __builtin_return_address(0));
+}
+
+void* operator new[](size_t size) {
+    return chipport::profiledAllocate(size, __builtin_return_address(0));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return chipport::profiledAllocate(size, __builtin_return_address(0));
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return chipport::profiledAllocate(size, __builtin_return_address(0));
+    } catch (...) {
+        return nullptr;
+    }
+}
+#endif
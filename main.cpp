@@ -1,238 +1,319 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <string>
-#include <cstring>
-#include <map>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <algorithm>
-#include <list>
-#include <unordered_map>
-
-#define STATUS_SUCCESS 200
-#define STATUS_NOT_FOUND 404
-#define STATUS_METHOD_NOT_ALLOWED 405
-
-void log(const std::string& level, const std::string& className, const std::string& method, const std::string& why, const std::string& data) {
-    std::cout << "[" << level << "][" << className << "][" << method << "] <" << why << "> " << data << std::endl;
+// This program carries the operator new replacement behind /admin/heap and --heap
+#define CHIPPORT_HEAP_PROFILER
+#include "chipport.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+
+using namespace chipport;
+
+// The demo site served from ./templates and ./static.
+void registerRoutes(RequestHandler& handler) {
+    RouteEntry index = {{"GET"}, "./templates/index.html", true};
+    handler.addRoute("/", index);
+
+    RouteEntry test1 = {{"GET"}, "./templates/test.html", true};
+    handler.addRoute("/test/get", test1);
+    auto cors = std::make_shared<CorsPolicy>();
+    cors->allowedOrigins = {"*"};
+    RouteEntry test2 = {{"POST"}, "./templates/test.html", true};
+    test2.cors = cors;
+    handler.addRoute("/test/post", test2);
+    RouteEntry test3 = {{"PUT"}, "./templates/test.html", true};
+    test3.cors = cors;
+    handler.addRoute("/test/put", test3);
+    RouteEntry test4 = {{"GET", "POST"}, "./templates/test.html", true};
+    test4.cors = cors;
+    handler.addRoute("/test/post-get", test4);
+
+    RouteEntry style = {{"GET"}, "./static/css/style.css", true};
+    handler.addRoute("/static/style.css", style);
+
+    RouteEntry favicon = {{"GET"}, "./static/img/favicon.jpg", true};
+    handler.addRoute("/favicon.ico", favicon);
+
+    // Stands in for a handler that blocks, e.g. on a database; run off the event loop
+    handler.addHandler("/test/report", {"GET"}, [](const Request&) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return Response{STATUS_SUCCESS, "<html><body>Report ready</body></html>", "text/html"};
+    }, true);
 }
 
-std::string getContentType(const std::string& filename) {
-    std::unordered_map<std::string, std::string> extensionToContentType = {
-        {".html", "text/html"},
-        {".jpg", "image/jpeg"},
-        {".jpeg", "image/jpeg"},
-        {".png", "image/png"},
-        {".css", "text/css"},
-        {".js", "application/javascript"}
+// Pushes pipelined batches of requests through a loopback connection, so the
+// figure covers parsing, routing, handleRequest and response serialization
+// without socket syscalls. Runs on one thread: the result is per core. With
+// `heapSampleBytes` set, allocations are sampled that often and reported per
+// request by call site.
+int benchmarkLoopback(size_t totalRequests, size_t heapSampleBytes) {
+    static const char* corpus[] = {
+        "GET / HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nAccept: */*\r\n\r\n",
+        "GET /static/style.css HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\nAccept: text/css\r\n\r\n",
+        "GET /test/get?page=2&sort=name HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n",
+        "GET /favicon.ico HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n",
+        "GET /static/../test/./get HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n",
+        "GET /missing HTTP/1.1\r\nHost: localhost\r\nUser-Agent: bench\r\n\r\n",
     };
+    const size_t corpusSize = sizeof(corpus) / sizeof(corpus[0]);
+    const size_t batchSize = 32;
 
-    size_t dotPosition = filename.find_last_of('.');
-    if (dotPosition != std::string::npos) {
-        std::string extension = filename.substr(dotPosition);
-        if (extensionToContentType.count(extension)) {
-            log("INFO", "getContentType", "Extension match", "Content-Type found for", extension);
-            return extensionToContentType[extension];
-        } else {
-            log("WARN", "getContentType", "Extension mismatch", "No content type for", extension);
-        }
+    std::string batch;
+    for (size_t i = 0; i < batchSize; ++i) {
+        batch += corpus[i % corpusSize];
     }
-    return "application/octet-stream"; // Default content type if no match found
-}
 
-struct Request {
-    std::string method;
-    std::string path;
-    std::string httpVersion;
-    std::map<std::string, std::string> headers;
-    std::string body;
-
-    Request(const std::string& requestText) {
-        std::istringstream stream(requestText);
-        std::string line;
-        std::getline(stream, line);
-        std::istringstream requestLine(line);
-        requestLine >> method >> path >> httpVersion;
-
-        while (std::getline(stream, line) && line != "\r") {
-            auto colonPos = line.find(':');
-            if (colonPos != std::string::npos) {
-                std::string headerName = line.substr(0, colonPos);
-                std::string headerValue = line.substr(colonPos + 2, line.size() - colonPos - 3); // Skip colon and space, trim \r
-                headers[headerName] = headerValue;
-            }
+    // Request logging is muted, though its strings are still built
+    std::cout.setstate(std::ios::failbit);
+    double seconds;
+    size_t served = 0;
+    size_t responseBytes = 0;
+    std::string heapReport;
+    {
+        HttpServer server(std::vector<ListenAddress>{});
+        registerRoutes(server.getRequestHandler());
+        server.start();
+        LoopbackTransport transport;
+        int id = server.openLoopback(transport);
+
+        Profiler::registerThread();
+        if (heapSampleBytes > 0) {
+            HeapProfiler::start(heapSampleBytes);
         }
-
-        // Read body if present
-        std::string bodyContent;
-        while (std::getline(stream, bodyContent)) {
-            body += bodyContent + "\n";
+        auto start = std::chrono::steady_clock::now();
+        while (served < totalRequests) {
+            transport.push(id, batch);
+            if (!server.deliver(id)) {
+                break;
+            }
+            served += batchSize;
+            responseBytes += transport.output(id).size();
+            transport.output(id).clear();
         }
-        log("INFO", "Request", "Constructor", "Parsed request", "Method: " + method + ", Path: " + path);
-    }
-};
-
-struct Response {
-    int code;
-    std::string body;
-    std::string contentType;
-
-    std::string buildResponse() const {
-        std::ostringstream response;
-        response << "HTTP/1.1 " << code << " "
-                 << (code == STATUS_SUCCESS ? "OK" : (code == STATUS_NOT_FOUND ? "Not Found" : "Method Not Allowed")) << "\n"
-                 << "Content-Type: " << contentType << "\n"
-                 << "Content-Length: " << body.length() << "\n\n"
-                 << body;
-        return response.str();
-    }
-};
-
-struct RouteEntry {
-    std::list<std::string> allowedMethods;
-    std::string content;
-    bool isFile;
-};
-
-class RequestHandler {
-public:
-    RequestHandler() {
-        RouteEntry index = {{"GET"}, "./templates/index.html", true};
-        routeLookUp["/"] = index;
-
-        RouteEntry test1 = {{"GET"}, "./templates/test.html", true};
-        routeLookUp["/test/get"] = test1;
-        RouteEntry test2 = {{"POST"}, "./templates/test.html", true};
-        routeLookUp["/test/post"] = test2;
-        RouteEntry test3 = {{"PUT"}, "./templates/test.html", true};
-        routeLookUp["/test/put"] = test3;   
-        RouteEntry test4 = {{"GET", "POST"}, "./templates/test.html", true};
-        routeLookUp["/test/post-get"] = test4;   
-
-        RouteEntry style = {{"GET"}, "./static/css/style.css", true};
-        routeLookUp["/static/style.css"] = style; 
-
-        RouteEntry favicon = {{"GET"}, "./static/img/favicon.jpg", true};
-        routeLookUp["/favicon.ico"] = favicon;
-    }
-
-    Response handleRequest(const Request& request) {
-        auto route = routeLookUp.find(request.path);
-        if (route == routeLookUp.end()) {
-            log("ERROR", "handleRequest", "Route not found", "No route for", request.path);
-            return {STATUS_NOT_FOUND, "<html><body>404 Route Not Found: " + request.path + "</body></html>", "text/html"};
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (heapSampleBytes > 0) {
+            heapReport = HeapProfiler::stop(served, false);
         }
+    }
+    std::cout.clear();
 
-        const auto& allowedMethods = route->second.allowedMethods;
-        if (std::find(allowedMethods.begin(), allowedMethods.end(), request.method) == allowedMethods.end()) {
-            std::string allowed;
-            for (const auto& method : allowedMethods) {
-                allowed += method + " ";
-            }
-            log("ERROR", "handleRequest", "Method not allowed", "Method: " + request.method + " not allowed for", request.path);
-            return {STATUS_METHOD_NOT_ALLOWED, "<html><body>405 Method Not Allowed: " + request.method + " not allowed for " + request.path + ". Allowed methods: " + allowed + "</body></html>", "text/html"};
-        }
+    if (served < totalRequests) {
+        log("ERROR", "benchmarkLoopback", "Loopback connection closed", "Served", std::to_string(served));
+        return EXIT_FAILURE;
+    }
+    std::cout << "requests " << served << "\n"
+              << "seconds " << seconds << "\n"
+              << "requests/second " << static_cast<uint64_t>(served / seconds) << "\n"
+              << "response bytes/request " << responseBytes / served << std::endl;
+    if (!heapReport.empty()) {
+        std::cout << "\n" << heapReport << std::flush;
+    }
+    return EXIT_SUCCESS;
+}
 
-        if (route->second.isFile) {
-            std::ifstream file(route->second.content);
-            if (!file) {
-                log("ERROR", "handleRequest", "File not found", "Failed to open", route->second.content);
-                return {STATUS_NOT_FOUND, "<html><body>404 Resource Not Found: " + request.path + "</body></html>", "text/html"};
-            }
-            std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-            std::string contentType = getContentType(route->second.content);
-            log("INFO", "handleRequest", "File served", "Serving content from", route->second.content);
-            return {STATUS_SUCCESS, content, contentType};
-        } else {
-            return {STATUS_SUCCESS, route->second.content, "text/html"};
+// Kernel TCP memory in bytes, summed over every socket on the host.
+static long tcpKernelMemory() {
+    std::ifstream sockstat("/proc/net/sockstat");
+    std::string line;
+    while (std::getline(sockstat, line)) {
+        size_t mem = line.find(" mem ");
+        if (line.compare(0, 4, "TCP:") == 0 && mem != std::string::npos) {
+            return std::stol(line.substr(mem + 5)) * sysconf(_SC_PAGESIZE);
         }
     }
+    return 0;
+}
 
-private:
-    std::map<std::string, RouteEntry> routeLookUp;
-};
-
-class HttpServer {
-public:
-    HttpServer(int port, int backlog = 10) : port(port), backlog(backlog), server_fd(0), client_socket(0) {
-        address.sin_family = AF_INET;
-        address.sin_addr.s_addr = INADDR_ANY;
-        address.sin_port = htons(port);
+static long residentMemory() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return std::stol(line.substr(6)) * 1024;
+        }
     }
+    return 0;
+}
 
-    ~HttpServer() {
-        close(server_fd);
-        log("INFO", "HttpServer", "Destructor", "Server shutdown", "Port: " + std::to_string(port));
+// Opens `connections` downloads of one large file from a forked client that
+// never reads, then reports kernel TCP memory and server RSS per connection with
+// the server's socket tuning off and on.
+int benchmarkDownloads(size_t connections) {
+    // Each side of every connection needs a descriptor, hence the separate client process
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < connections + 64) {
+        log("ERROR", "benchmarkDownloads", "Descriptor limit too low", "Limit", std::to_string(limit.rlim_cur));
+        return EXIT_FAILURE;
     }
 
-    bool initialize() {
-        server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd == -1) {
-            log("ERROR", "HttpServer", "initialize", "Socket creation", "failed");
-            return false;
+    char path[] = "/tmp/chipport-download-XXXXXX";
+    int fileFd = mkstemp(path);
+    if (fileFd == -1 || ftruncate(fileFd, 4 * 1024 * 1024) == -1) {
+        log("ERROR", "benchmarkDownloads", "Creating download file", "failed", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    close(fileFd);
+
+    std::cout.setstate(std::ios::failbit);
+    std::ostringstream report;
+    for (bool tuning : {false, true}) {
+        HttpServer server(std::vector<ListenAddress>{{"127.0.0.1:0"}}, 4096);
+        RouteEntry download = {{"GET"}, path, true};
+        server.getRequestHandler().addRoute("/download", download);
+        server.setSocketTuning(tuning);
+        if (!server.start()) {
+            break;
         }
-
-        int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
-            log("ERROR", "HttpServer", "initialize", "Setting socket options", "failed");
-            return false;
+        const Listener& listener = server.getListeners().front();
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        getsockname(listener.fd, reinterpret_cast<struct sockaddr*>(&address), &addressLength);
+        int done[2];
+        if (pipe(done) == -1) {
+            log("ERROR", "benchmarkDownloads", "Creating pipe", "failed", strerror(errno));
+            break;
         }
-
-        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
-            log("ERROR", "HttpServer", "initialize", "Binding socket", "failed");
-            return false;
+        std::thread loop([&server] { server.run(); });
+        long kernelBefore = tcpKernelMemory();
+        long residentBefore = residentMemory();
+        pid_t client = fork();
+        if (client == -1) {
+            log("ERROR", "benchmarkDownloads", "Forking the client", "failed", strerror(errno));
+            close(done[0]);
+            close(done[1]);
+            server.stop();
+            loop.join();
+            break;
         }
-
-        if (listen(server_fd, backlog) == -1) {
-            log("ERROR", "HttpServer", "initialize", "Listening on socket", "failed");
-            return false;
+        if (client == 0) {
+            close(done[1]);
+            static const char request[] = "GET /download HTTP/1.1\r\nHost: bench\r\n\r\n";
+            for (size_t i = 0; i < connections; ++i) {
+                int fd = socket(AF_INET, SOCK_STREAM, 0);
+                // A slow reader: a small window it never drains
+                int receiveBuffer = 4096;
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+                if (fd == -1 || connect(fd, reinterpret_cast<struct sockaddr*>(&address), addressLength) == -1 ||
+                    write(fd, request, sizeof(request) - 1) == -1) {
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            char byte;
+            while (read(done[0], &byte, 1) > 0) {
+            }
+            _exit(EXIT_SUCCESS);
         }
+        close(done[0]);
 
-        log("INFO", "HttpServer", "initialize", "Server initialization", "successful");
-        return true;
+        // Every connection accepted, then time for the server to fill what the kernel will take
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (listener.active < connections && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(2));
+        size_t accepted = listener.active;
+        long kernel = tcpKernelMemory() - kernelBefore;
+        long resident = residentMemory() - residentBefore;
+
+        close(done[1]);
+        waitpid(client, nullptr, 0);
+        server.stop();
+        loop.join();
+
+        size_t divisor = std::max<size_t>(accepted, 1);
+        report << (tuning ? "tuned" : "untuned") << ": connections " << accepted
+               << " kernel_tcp_bytes/connection " << kernel / static_cast<long>(divisor)
+               << " server_rss_bytes/connection " << resident / static_cast<long>(divisor) << "\n";
     }
+    std::cout.clear();
+    unlink(path);
+    std::cout << report.str() << std::flush;
+    return EXIT_SUCCESS;
+}
 
-    void run() {
-        log("INFO", "HttpServer", "run", "Server start", "Waiting for connections...");
-        char buffer[3000] = {0};
-
-        while (true) {
-            socklen_t addrlen = sizeof(address);
-            client_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-            if (client_socket == -1) {
-                log("ERROR", "HttpServer", "run", "Accepting connection", "failed");
-                continue;
+// Usage: server [--listen ADDRESS[,proxy][,admin]]... [--proxy-protocol] [--max-connections N] [--minify]
+//               [--threads N] [--handler-threads N] [--capture FILE [--capture-every N]]
+//               [--asset-threads N] [--warm-fraction F]
+//        server --bench-loopback REQUESTS [--heap SAMPLE_BYTES]
+//        server --bench-downloads CONNECTIONS
+int main(int argc, char* argv[]) {
+    std::vector<ListenAddress> addresses;
+    bool proxyProtocol = false;
+    size_t maxConnections = 0;
+    bool minify = false;
+    unsigned threads = 1;
+    size_t handlerThreads = 0;
+    std::string captureFile;
+    unsigned captureEvery = 100;
+    size_t assetThreads = 0;
+    double warmFraction = 1.0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--proxy-protocol") == 0) {
+            proxyProtocol = true;
+        } else if (strcmp(argv[i], "--minify") == 0) {
+            minify = true;
+        } else if (strcmp(argv[i], "--bench-loopback") == 0 && i + 1 < argc) {
+            size_t requests = strtoul(argv[++i], nullptr, 10);
+            size_t heapSampleBytes = 0;
+            if (i + 2 < argc && strcmp(argv[i + 1], "--heap") == 0) {
+                heapSampleBytes = strtoul(argv[i + 2], nullptr, 10);
             }
-            memset(buffer, 0, sizeof(buffer));
-            read(client_socket, buffer, sizeof(buffer) - 1);
-            Request request(buffer);
-            log("INFO", "HttpServer", "run", "Request received", "Path: " + request.path);
-
-            Response response = requestHandler.handleRequest(request);
-            std::string httpResponse = response.buildResponse();
-
-            write(client_socket, httpResponse.c_str(), httpResponse.size());
-            log("INFO", "HttpServer", "run", "Response sent", "Content Length: " + std::to_string(httpResponse.size()));
-            close(client_socket);
+            return benchmarkLoopback(requests, heapSampleBytes);
+        } else if (strcmp(argv[i], "--bench-downloads") == 0 && i + 1 < argc) {
+            return benchmarkDownloads(strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = std::max(1UL, strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--handler-threads") == 0 && i + 1 < argc) {
+            handlerThreads = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            captureFile = argv[++i];
+        } else if (strcmp(argv[i], "--capture-every") == 0 && i + 1 < argc) {
+            captureEvery = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--asset-threads") == 0 && i + 1 < argc) {
+            assetThreads = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--warm-fraction") == 0 && i + 1 < argc) {
+            warmFraction = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+            maxConnections = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            std::string spec = argv[++i];
+            ListenAddress address;
+            address.spec = spec.substr(0, spec.find(','));
+            address.proxyProtocol = spec.find(",proxy") != std::string::npos;
+            address.admin = spec.find(",admin") != std::string::npos;
+            addresses.push_back(address);
         }
     }
+    if (addresses.empty()) {
+        addresses.push_back({"0.0.0.0:8080"});
+    }
+    for (auto& address : addresses) {
+        address.proxyProtocol = address.proxyProtocol || proxyProtocol;
+    }
 
-private:
-    RequestHandler requestHandler;
-    int server_fd;
-    int client_socket;
-    struct sockaddr_in address;
-    int port;
-    int backlog;
-};
-
-int main() {
-    HttpServer server(8080);
-    if (!server.initialize()) {
+    HttpServer server(addresses, 10, maxConnections);
+    server.addFastPath("GET", "/healthz", "text/plain", "OK");
+    registerRoutes(server.getRequestHandler());
+    server.getRequestHandler().setMinify(minify);
+    server.getRequestHandler().setAssetThreads(assetThreads);
+    server.getRequestHandler().setWarmFraction(warmFraction);
+    server.setHandlerThreads(handlerThreads);
+    if (!captureFile.empty()) {
+        server.setCapture(captureFile, captureEvery);
+    }
+    if (!server.start()) {
         return EXIT_FAILURE;
     }
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i) {
+        workers.emplace_back([&server] { server.run(); });
+    }
     server.run();
+    for (auto& worker : workers) {
+        worker.join();
+    }
     return EXIT_SUCCESS;
 }